@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "protocol.h"
+#include "datalink.h"
+#include "colink.h"
+
+#define DATA_TIMER  2000
+
+struct FRAME {
+    unsigned char kind; /* FRAME_DATA */
+    unsigned char ack;
+    unsigned char seq;
+    unsigned char data[PKT_LEN];
+    unsigned int  padding;
+};
+
+/* Stop-and-wait written as two independent tasks sharing one link */
+
+struct sender {
+    struct co_task task;
+    unsigned char seq;
+    struct FRAME s;
+};
+
+struct receiver {
+    struct co_task task;
+    unsigned char frame_expected;
+    struct FRAME s;
+};
+
+static void put_frame(struct co_task *t, unsigned char *frame, int len)
+{
+    co_send_frame_crc(t, frame, len);
+}
+
+static int sender(struct co_task *t)
+{
+    struct sender *snd = (struct sender *)t;
+    struct FRAME *f = (struct FRAME *)t->link->frame;
+
+    co_begin(t);
+
+    for (;;) {
+        co_await_writable(t);
+        co_await_packet(t);
+        co_get_packet(t, snd->s.data);
+
+        snd->s.kind = FRAME_DATA;
+        snd->s.seq = snd->seq;
+        snd->s.ack = 0;
+
+        do {
+            dbg_frame("Send DATA %d, ID %d\n", snd->s.seq, *(short *)snd->s.data);
+            put_frame(t, (unsigned char *)&snd->s, 3 + PKT_LEN);
+            co_start_timer(t, 0, DATA_TIMER);
+
+            /* wait for our ACK, ignoring everything else on the link */
+            do {
+                co_await(t, CO_FRAME | CO_TIMEOUT);
+            } while (t->event == CO_FRAME &&
+                !(t->link->crc_ok && f->kind == FRAME_ACK && f->ack == snd->seq));
+
+            if (t->event == CO_TIMEOUT)
+                dbg_event("---- DATA %d timeout\n", snd->seq);
+        } while (t->event == CO_TIMEOUT);
+
+        dbg_frame("Recv ACK  %d\n", f->ack);
+        co_stop_timer(t, 0);
+        snd->seq = 1 - snd->seq;
+    }
+
+    co_end(t);
+}
+
+static int receiver(struct co_task *t)
+{
+    struct receiver *rcv = (struct receiver *)t;
+    struct FRAME *f = (struct FRAME *)t->link->frame;
+
+    co_begin(t);
+
+    for (;;) {
+        co_await_frame(t);
+
+        if (!t->link->crc_ok) {
+            dbg_event("**** Receiver Error, Bad CRC Checksum\n");
+            continue;
+        }
+        if (f->kind != FRAME_DATA)
+            continue;
+
+        dbg_frame("Recv DATA %d, ID %d\n", f->seq, *(short *)f->data);
+        if (f->seq == rcv->frame_expected) {
+            put_packet(f->data, t->link->len - 7);
+            rcv->frame_expected = 1 - rcv->frame_expected;
+        }
+
+        rcv->s.kind = FRAME_ACK;
+        rcv->s.ack = f->seq;
+        dbg_frame("Send ACK  %d\n", rcv->s.ack);
+        put_frame(t, (unsigned char *)&rcv->s, 2);
+    }
+
+    co_end(t);
+}
+
+int main(int argc, char **argv)
+{
+    static struct co_link link;
+    static struct sender snd;
+    static struct receiver rcv;
+
+    protocol_init(argc, argv);
+    lprintf("Designed by Suo Zhengduo, build: " __DATE__"  "__TIME__"\n");
+
+    co_spawn(&link, &snd.task, sender, 1);
+    co_spawn(&link, &rcv.task, receiver, 0);
+    co_run(&link);
+
+    return 0;
+}
@@ -6,7 +6,8 @@
 
 #define DATA_TIMER 4500
 #define ACK_TIMER 300
-#define MAX_SEQ 7
+#define MAX_SEQ 255
+#define NR_WINDOW 7 //ʹ. һֽ, ACK/NAK(--ctrl-lane)ٵӴȷڴ֮
 
 struct FRAME {
 	unsigned char kind; //֡(֡(1)ACK֡(2)NAK֡(3))
@@ -21,13 +22,24 @@ static unsigned char nbuffered = 0; //
 static unsigned char frame_expected = 0; //շ
 static unsigned char next_frame_to_send = 0; //ͷ
 static unsigned char ack_expected = 0; //ͷ
+static unsigned int send_handle[MAX_SEQ + 1]; //Ͷи֡ľ, ڳػԭظ
+static unsigned int ack_handle = 0; //ͶһACK֡ľ
 static int phl_ready = 0; //־׼״̬
 
-static void put_frame(unsigned char* frame, int len)
+static unsigned int put_frame(unsigned char* frame, int len)
 {
-	*(unsigned int*)(frame + len) = crc32(frame, len);
-	send_frame(frame, len + 4);
+	unsigned int handle = send_frame_crc(frame, len);
+
 	phl_ready = 0;
+	return handle;
+}
+
+/* ֡δʱԭػ֡,  */
+static unsigned int repost_frame(unsigned int handle, unsigned char* frame, int len)
+{
+	if (replace_frame(handle, frame, len))
+		return handle;
+	return put_frame(frame, len);
 }
 
 static unsigned char inc(unsigned char nr)
@@ -52,7 +64,8 @@ static void send_data_frame(unsigned char next_frame_to_send, unsigned char fram
 
 	start_timer(next_frame_to_send, DATA_TIMER);
 	dbg_frame("Send DATA %d %d, ID %d\n", s.seq, s.ack, *(short*)s.data);
-	put_frame((unsigned char*)&s, 3 + PKT_LEN);
+	cancel_frame(send_handle[next_frame_to_send]); //ط: ضδľɸ, Ŷ
+	send_handle[next_frame_to_send] = put_frame((unsigned char*)&s, 3 + PKT_LEN);
 
 	stop_ack_timer();
 }
@@ -66,7 +79,7 @@ static void send_ack_frame(void)
 
 	dbg_frame("Send ACK %d\n", s.ack);
 
-	put_frame((unsigned char*)&s, 2);
+	ack_handle = repost_frame(ack_handle, (unsigned char*)&s, 2);
 	stop_ack_timer();
 }
 
@@ -85,9 +98,10 @@ static void send_nak_frame(void)
 
 int main(int argc, char** argv)
 {
-	int event, arg;
+	int event, arg, e, nevents;
+	struct event evs[MAX_EVENTS];
 	struct FRAME f;
-	int len = 0;
+	int len = 0, crc_ok;
 
 	protocol_init(argc, argv);
 	lprintf("Designed by Suo Zhengduo, build: " __DATE__"  "__TIME__"\n");
@@ -95,76 +109,82 @@ int main(int argc, char** argv)
 	enable_network_layer();
 
 	for (;;) {
-		event = wait_for_event(&arg);
-
-		switch (event) {
-		case NETWORK_LAYER_READY:
-			get_packet(send_buffer[next_frame_to_send]);
-			nbuffered++;
-			send_data_frame(next_frame_to_send, frame_expected);
-			next_frame_to_send = inc(next_frame_to_send);
-			break;
-
-		case PHYSICAL_LAYER_READY:
-			phl_ready = 1;
-			break;
-
-		case FRAME_RECEIVED:
-			len = recv_frame((unsigned char*)&f, sizeof f);
-			if (len < 5 || crc32((unsigned char*)&f, len) != 0) {
-				dbg_event("**** Receiver Error, Bad CRC Checksum\n");
-				send_nak_frame(); //NAK֪ͨش
+		nevents = wait_for_events(evs, MAX_EVENTS);
+
+		for (e = 0; e < nevents; e++) {
+			event = evs[e].type;
+			arg = evs[e].arg;
+
+			switch (event) {
+			case NETWORK_LAYER_READY:
+				get_packet(send_buffer[next_frame_to_send]);
+				nbuffered++;
+				send_data_frame(next_frame_to_send, frame_expected);
+				next_frame_to_send = inc(next_frame_to_send);
 				break;
-			}
 
-			switch (f.kind) {
-			case FRAME_DATA:
-				dbg_frame("Recv DATA %d %d, ID %d\n", f.seq, f.ack, *(short*)f.data);
-				if (f.seq == frame_expected) {
-					put_packet(f.data, len - 7);
-					start_ack_timer(ACK_TIMER);
-					frame_expected = inc(frame_expected);
-				}
+			case PHYSICAL_LAYER_READY:
+				phl_ready = 1;
 				break;
 
-			case FRAME_ACK:
-				dbg_frame("Recv ACK %d\n", f.ack);
+			case FRAME_RECEIVED:
+				len = recv_frame_crc((unsigned char*)&f, sizeof f, &crc_ok);
+				if (!crc_ok) {
+					dbg_event("**** Receiver Error, Bad CRC Checksum\n");
+					send_nak_frame(); //NAK֪ͨش
+					break;
+				}
+
+				switch (f.kind) {
+				case FRAME_DATA:
+					dbg_frame("Recv DATA %d %d, ID %d\n", f.seq, f.ack, *(short*)f.data);
+					if (f.seq == frame_expected) {
+						put_packet(f.data, len - 7);
+						start_ack_timer(ACK_TIMER);
+						frame_expected = inc(frame_expected);
+					}
+					break;
+
+				case FRAME_ACK:
+					dbg_frame("Recv ACK %d\n", f.ack);
+					break;
+
+				case FRAME_NAK:
+					dbg_frame("Recv NAK %d\n", f.ack);
+					next_frame_to_send = ack_expected;
+					for (unsigned char i = 1; i <= nbuffered; i++) { //ش֡
+						send_data_frame(next_frame_to_send, frame_expected);
+						next_frame_to_send = inc(next_frame_to_send);
+					}
+					break;
+				}
+
+				while (between(ack_expected, f.ack, next_frame_to_send)) { //ۻȷ
+					cancel_frame(send_handle[ack_expected]); //ȷϵ֡ط
+					stop_timer(ack_expected);
+					nbuffered--;
+					ack_expected = inc(ack_expected);
+				}
+
 				break;
 
-			case FRAME_NAK:
-				dbg_frame("Recv NAK %d\n", f.ack);
+			case DATA_TIMEOUT:
+				dbg_event("---- DATA %d timeout\n", arg);
 				next_frame_to_send = ack_expected;
-				for (unsigned char i = 1; i <= nbuffered; i++) { //ش֡
+				for (unsigned char i = 1; i <= nbuffered; i++) { //شе֡
 					send_data_frame(next_frame_to_send, frame_expected);
 					next_frame_to_send = inc(next_frame_to_send);
 				}
 				break;
-			}
-
-			while (between(ack_expected, f.ack, next_frame_to_send)) { //ۻȷ
-				stop_timer(ack_expected);
-				nbuffered--;
-				ack_expected = inc(ack_expected);
-			}
-
-			break;
 
-		case DATA_TIMEOUT:
-			dbg_event("---- DATA %d timeout\n", arg);
-			next_frame_to_send = ack_expected;
-			for (unsigned char i = 1; i <= nbuffered; i++) { //شе֡
-				send_data_frame(next_frame_to_send, frame_expected);
-				next_frame_to_send = inc(next_frame_to_send);
+			case ACK_TIMEOUT:
+				dbg_event("---- ACK %d timeout\n", (frame_expected + MAX_SEQ) % (MAX_SEQ + 1));
+				send_ack_frame();
+				break;
 			}
-			break;
-
-		case ACK_TIMEOUT:
-			dbg_event("---- ACK %d timeout\n", (frame_expected + MAX_SEQ) % (MAX_SEQ + 1));
-			send_ack_frame();
-			break;
 		}
 
-		if (nbuffered < MAX_SEQ && phl_ready)
+		if (nbuffered < NR_WINDOW && phl_ready)
 			enable_network_layer();
 		else
 			disable_network_layer();
@@ -26,8 +26,7 @@ static int phl_ready = 0;
 
 static void put_frame(unsigned char *frame, int len)
 {
-    *(unsigned int *)(frame + len) = crc32(frame, len);
-    send_frame(frame, len + 4);
+    send_frame_crc(frame, len);
     phl_ready = 0;
 }
 
@@ -59,9 +58,10 @@ static void send_data_frame(unsigned char frame_nr, unsigned char frame_expected
 
 int main(int argc, char **argv)
 {
-    int event, arg;
+    int event, arg, e, nevents;
+    struct event evs[MAX_EVENTS];
     struct FRAME f;
-    int len = 0;
+    int len = 0, crc_ok;
 
     protocol_init(argc, argv); 
     lprintf("Designed by Suo Zhengduo, build: " __DATE__"  "__TIME__"\n");
@@ -69,48 +69,53 @@ int main(int argc, char **argv)
     enable_network_layer();
 
     for (;;) {
-        event = wait_for_event(&arg);
-
-        switch (event) {
-        case NETWORK_LAYER_READY:
-            get_packet(send_buffer[next_frame_to_send]);
-            nbuffered++;
-            send_data_frame(next_frame_to_send,frame_expected);
-            next_frame_to_send = inc(next_frame_to_send);
-            break;
-
-        case PHYSICAL_LAYER_READY:
-            phl_ready = 1;
-            break;
-
-        case FRAME_RECEIVED: 
-            len = recv_frame((unsigned char *)&f, sizeof f);
-            if (len < 5 || crc32((unsigned char *)&f, len) != 0) {
-                dbg_event("**** Receiver Error, Bad CRC Checksum\n");
-                break;
-            }
+        nevents = wait_for_events(evs, MAX_EVENTS);
 
-            dbg_frame("Recv DATA %d %d, ID %d\n", f.seq, f.ack, *(short *)f.data);
-            if (f.seq == frame_expected) {
-                put_packet(f.data, len - 7);
-                frame_expected = inc(frame_expected);
-            }
-
-            while (between(ack_expected, f.ack, next_frame_to_send)) {
-                stop_timer(ack_expected);
-                nbuffered--;
-                ack_expected = inc(ack_expected);
-            }
-            break; 
+        for (e = 0; e < nevents; e++) {
+            event = evs[e].type;
+            arg = evs[e].arg;
 
-        case DATA_TIMEOUT:
-            dbg_event("---- DATA %d timeout\n", arg); 
-            next_frame_to_send = ack_expected;
-            for (unsigned char i = 1; i <= nbuffered; i++) {
-                send_data_frame(next_frame_to_send, frame_expected);
+            switch (event) {
+            case NETWORK_LAYER_READY:
+                get_packet(send_buffer[next_frame_to_send]);
+                nbuffered++;
+                send_data_frame(next_frame_to_send,frame_expected);
                 next_frame_to_send = inc(next_frame_to_send);
+                break;
+
+            case PHYSICAL_LAYER_READY:
+                phl_ready = 1;
+                break;
+
+            case FRAME_RECEIVED: 
+                len = recv_frame_crc((unsigned char *)&f, sizeof f, &crc_ok);
+                if (!crc_ok) {
+                    dbg_event("**** Receiver Error, Bad CRC Checksum\n");
+                    break;
+                }
+
+                dbg_frame("Recv DATA %d %d, ID %d\n", f.seq, f.ack, *(short *)f.data);
+                if (f.seq == frame_expected) {
+                    put_packet(f.data, len - 7);
+                    frame_expected = inc(frame_expected);
+                }
+
+                while (between(ack_expected, f.ack, next_frame_to_send)) {
+                    stop_timer(ack_expected);
+                    nbuffered--;
+                    ack_expected = inc(ack_expected);
+                }
+                break; 
+
+            case DATA_TIMEOUT:
+                dbg_event("---- DATA %d timeout\n", arg); 
+                next_frame_to_send = ack_expected;
+                for (unsigned char i = 1; i <= nbuffered; i++) {
+                    send_data_frame(next_frame_to_send, frame_expected);
+                    next_frame_to_send = inc(next_frame_to_send);
+                }
+                break;
             }
-            break;
         }
 
         if (nbuffered < MAX_SEQ && phl_ready)
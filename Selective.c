@@ -26,6 +26,8 @@ static unsigned char next_frame_to_send = 0; //
 static unsigned char ack_expected = 0; //ͷ
 static unsigned char too_far = NR_BUFS; //շ
 static unsigned char no_nak = 1; //־λ־ǷNAK
+static unsigned int send_handle[NR_BUFS]; //Ͷи֡ľ, ڳػԭظ
+static unsigned int ack_handle = 0; //ͶһACK֡ľ
 static int phl_ready = 0; //־׼״̬
 
 static inline unsigned char inc(unsigned char nr)
@@ -39,11 +41,20 @@ static unsigned char between(unsigned char a, unsigned char b, unsigned char c)
     return 0;
 }
 
-static void put_frame(unsigned char *frame, int len)
+static unsigned int put_frame(unsigned char *frame, int len)
 {
-    *(unsigned int *)(frame + len) = crc32(frame, len);
-    send_frame(frame, len + 4);
+    unsigned int handle = send_frame_crc(frame, len);
+
     phl_ready = 0;
+    return handle;
+}
+
+/* ֡δʱԭػ֡,  */
+static unsigned int repost_frame(unsigned int handle, unsigned char *frame, int len)
+{
+    if (replace_frame(handle, frame, len))
+        return handle;
+    return put_frame(frame, len);
 }
 
 static void send_data_frame(unsigned char fk, unsigned char next_frame_to_send, unsigned char frame_expected)
@@ -59,11 +70,11 @@ static void send_data_frame(unsigned char fk, unsigned char next_frame_to_send,
         memcpy(s.data, send_buffer[next_frame_to_send % NR_BUFS], PKT_LEN);
         dbg_frame("Send DATA %d %d, ID %d\n", s.seq, s.ack, *(short*)s.data);
         start_timer(next_frame_to_send % NR_BUFS, DATA_TIMER);
-        put_frame((unsigned char*)&s, 3 + PKT_LEN);
+        send_handle[next_frame_to_send % NR_BUFS] = repost_frame(send_handle[next_frame_to_send % NR_BUFS], (unsigned char*)&s, 3 + PKT_LEN);
         break;
     case FRAME_ACK:
         dbg_frame("Send ACK %d\n", s.ack);
-        put_frame((unsigned char*)&s, 2);
+        ack_handle = repost_frame(ack_handle, (unsigned char*)&s, 2);
         break;
     case FRAME_NAK:
         no_nak = 0; //ѷNAKλNAK
@@ -77,9 +88,10 @@ static void send_data_frame(unsigned char fk, unsigned char next_frame_to_send,
 
 int main(int argc, char **argv)
 {
-    int event, arg;
+    int event, arg, e, nevents;
+    struct event evs[MAX_EVENTS];
     struct FRAME f;
-    int len = 0;
+    int len = 0, crc_ok;
     for (unsigned i = 0; i < NR_BUFS; i++) arrived[i] = 0; //δյ֡
 
     protocol_init(argc, argv); 
@@ -88,77 +100,83 @@ int main(int argc, char **argv)
     enable_network_layer();
 
     for (;;) {
-        event = wait_for_event(&arg);
-
-        dbg_frame("Window : %d\n", nbuffered);
-
-        switch (event) {
-        case NETWORK_LAYER_READY:
-            get_packet(send_buffer[next_frame_to_send % NR_BUFS]);
-            nbuffered++;
-            send_data_frame(FRAME_DATA, next_frame_to_send, frame_expected);
-            next_frame_to_send = inc(next_frame_to_send);
-            break;
-
-        case PHYSICAL_LAYER_READY:
-            phl_ready = 1;
-            break;
-
-        case FRAME_RECEIVED:
-            len = recv_frame((unsigned char*)&f, sizeof f);
-            if (len < 5 || crc32((unsigned char*)&f, len) != 0) {
-                dbg_event("**** Receiver Error, Bad CRC Checksum\n");
-                if (no_nak) send_data_frame(FRAME_NAK, 0, frame_expected);
+        nevents = wait_for_events(evs, MAX_EVENTS);
+
+        for (e = 0; e < nevents; e++) {
+            event = evs[e].type;
+            arg = evs[e].arg;
+
+            dbg_frame("Window : %d\n", nbuffered);
+
+            switch (event) {
+            case NETWORK_LAYER_READY:
+                get_packet(send_buffer[next_frame_to_send % NR_BUFS]);
+                nbuffered++;
+                send_data_frame(FRAME_DATA, next_frame_to_send, frame_expected);
+                next_frame_to_send = inc(next_frame_to_send);
                 break;
-            }
 
-            switch (f.kind) {
-            case FRAME_DATA:
-                dbg_frame("Recv DATA %d %d, ID %d\n", f.seq, f.ack, *(short*)f.data);
-                if ((f.seq != frame_expected) && no_nak) send_data_frame(FRAME_NAK, 0, frame_expected);
-                else start_ack_timer(ACK_TIMER);
-                if (between(frame_expected, f.seq, too_far) && (arrived[f.seq % NR_BUFS] == 0)) {
-                    arrived[f.seq % NR_BUFS] = 1;
-                    memcpy(recv_buffer[f.seq % NR_BUFS], f.data, PKT_LEN);
-                    while (arrived[frame_expected % NR_BUFS]) { //ύе֡
-                        put_packet(recv_buffer[frame_expected % NR_BUFS], len - 7);
-                        no_nak = 1; //յָ֡NAK־λ
-                        arrived[frame_expected % NR_BUFS] = 0;
-                        frame_expected = inc(frame_expected);
-                        too_far = inc(too_far);
-                        start_ack_timer(ACK_TIMER);
+            case PHYSICAL_LAYER_READY:
+                phl_ready = 1;
+                break;
+
+            case FRAME_RECEIVED:
+                len = recv_frame_crc((unsigned char*)&f, sizeof f, &crc_ok);
+                if (!crc_ok) {
+                    dbg_event("**** Receiver Error, Bad CRC Checksum\n");
+                    if (no_nak) send_data_frame(FRAME_NAK, 0, frame_expected);
+                    break;
+                }
+
+                switch (f.kind) {
+                case FRAME_DATA:
+                    dbg_frame("Recv DATA %d %d, ID %d\n", f.seq, f.ack, *(short*)f.data);
+                    if ((f.seq != frame_expected) && no_nak) send_data_frame(FRAME_NAK, 0, frame_expected);
+                    else start_ack_timer(ACK_TIMER);
+                    if (between(frame_expected, f.seq, too_far) && (arrived[f.seq % NR_BUFS] == 0)) {
+                        arrived[f.seq % NR_BUFS] = 1;
+                        memcpy(recv_buffer[f.seq % NR_BUFS], f.data, PKT_LEN);
+                        while (arrived[frame_expected % NR_BUFS]) { //ύе֡
+                            put_packet(recv_buffer[frame_expected % NR_BUFS], len - 7);
+                            no_nak = 1; //յָ֡NAK־λ
+                            arrived[frame_expected % NR_BUFS] = 0;
+                            frame_expected = inc(frame_expected);
+                            too_far = inc(too_far);
+                            start_ack_timer(ACK_TIMER);
+                        }
                     }
+                    break;
+
+                case FRAME_NAK:
+                    dbg_frame("Recv NAK %d\n", f.ack);
+                    if (between(ack_expected, (f.ack + 1) % (MAX_SEQ + 1), next_frame_to_send))
+                        send_data_frame(FRAME_DATA, (f.ack + 1) % (MAX_SEQ + 1), frame_expected);
+                    break;
+
+                case FRAME_ACK:
+                    dbg_frame("Recv ACK %d\n", f.ack);
+                    break;
                 }
-                break;
 
-            case FRAME_NAK:
-                dbg_frame("Recv NAK %d\n", f.ack);
-                if (between(ack_expected, (f.ack + 1) % (MAX_SEQ + 1), next_frame_to_send))
-                    send_data_frame(FRAME_DATA, (f.ack + 1) % (MAX_SEQ + 1), frame_expected);
+                while (between(ack_expected, f.ack, next_frame_to_send)) { //ۻȷ
+                    nbuffered--;
+                    cancel_frame(send_handle[ack_expected % NR_BUFS]); //ȷϵ֡ط
+                    stop_timer(ack_expected % NR_BUFS);
+                    ack_expected = inc(ack_expected);
+                }
                 break;
 
-            case FRAME_ACK:
-                dbg_frame("Recv ACK %d\n", f.ack);
+            case DATA_TIMEOUT:
+                dbg_event("---- DATA %d timeout\n", arg);
+                if (between(ack_expected, arg, next_frame_to_send)) send_data_frame(FRAME_DATA, arg, frame_expected);
+                else send_data_frame(FRAME_DATA, (arg + NR_BUFS) % (MAX_SEQ + 1), frame_expected);
                 break;
-            }
 
-            while (between(ack_expected, f.ack, next_frame_to_send)) { //ۻȷ
-                nbuffered--;
-                stop_timer(ack_expected % NR_BUFS);
-                ack_expected = inc(ack_expected);
+            case ACK_TIMEOUT:
+                dbg_event("---- ACK %d timeout\n", arg);
+                send_data_frame(FRAME_ACK, 0, frame_expected);
+                break;
             }
-            break;
-
-        case DATA_TIMEOUT:
-            dbg_event("---- DATA %d timeout\n", arg);
-            if (between(ack_expected, arg, next_frame_to_send)) send_data_frame(FRAME_DATA, arg, frame_expected);
-            else send_data_frame(FRAME_DATA, (arg + NR_BUFS) % (MAX_SEQ + 1), frame_expected);
-            break;
-
-        case ACK_TIMEOUT:
-            dbg_event("---- ACK %d timeout\n", arg);
-            send_data_frame(FRAME_ACK, 0, frame_expected);
-            break;
         }
 
         if (nbuffered < NR_BUFS && phl_ready)
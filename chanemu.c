@@ -0,0 +1,624 @@
+#ifndef	_CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+/*
+   chanemu: channel emulator between the stations
+
+   The stations of a pair do not talk to each other but to this relay
+   (station option --relay[=<port>]). It forwards the bytes each way and
+   applies the channel on the path: serialization at the bit rate, a
+   drop-tail queue in front of it, bit errors and the propagation delay.
+   The channel is set here once for every pair it serves, so it can be
+   changed without touching the protocol binaries.
+
+       chanemu --bps=64000 --delay=20 --ber=1e-5
+       Selective --relay A
+       Selective --relay B
+
+   The two stations of a pair find each other by their TCP port (-p), so
+   one relay serves several pairs at a time. Each connection starts with
+   a hello (station, framing codec wanted, port) before any channel data;
+   once both stations are in, the relay settles the codec the way station
+   A would and answers both with the codec, the channel and a common
+   epoch. The stations still pace what they send at the rate they are
+   told; the delay and the noise are left to the relay.
+*/
+
+#ifdef _WIN32 /* for Windows Visual Studio */
+
+#include <winsock.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "getopt.h"
+
+#define getopt_long getopt_int
+#define sock_errno() WSAGetLastError()
+#define SOCK_AGAIN WSAEWOULDBLOCK
+#define close_socket closesocket
+
+static void socket_init(void)
+{
+    WSADATA WSAData;
+
+    if (WSAStartup(MAKEWORD(1, 1), &WSAData) != 0) {
+        printf("Windows Socket DLL Error\n");
+        exit(0);
+    }
+}
+
+static void set_nonblock(int sock)
+{
+    u_long on = 1;
+
+    ioctlsocket(sock, FIONBIO, &on);
+}
+
+static long long monotonic_us(void)
+{
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER cnt;
+
+    if (freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&cnt);
+
+    return cnt.QuadPart / freq.QuadPart * 1000000 + cnt.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart;
+}
+
+#pragma comment(lib,"wsock32.lib")
+
+#else /* for Linux */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <time.h>
+
+#define sock_errno() errno
+#define SOCK_AGAIN EAGAIN
+#define close_socket close
+#define socket_init() signal(SIGPIPE, SIG_IGN)
+
+static void set_nonblock(int sock)
+{
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+}
+
+static long long monotonic_us(void)
+{
+    struct timespec tm;
+
+    clock_gettime(CLOCK_MONOTONIC, &tm);
+
+    return (long long)tm.tv_sec * 1000000 + tm.tv_nsec / 1000;
+}
+
+#endif
+
+#include <math.h>
+
+#define CHAN_BPS   8000      /* bits per second */
+#define CHAN_DELAY 270       /* ms */
+#define DEFAULT_CHAN_BER   1.0E-5
+#define DEFAULT_RELAY_PORT 59145
+
+#define MAX_PAIR  32
+#define MAX_PENDING 16       /* connections still sending their hello */
+#define HELLO_TIMEOUT 10     /* s */
+#define MAX_CHUNK 4096       /* bytes read from a station at a time */
+
+/* connection handshake, keep in step with relay_negotiate() of protocol.c */
+#define RELAY_MAGIC 0x52454c59
+
+struct RELAY_HELLO {
+    unsigned int magic;
+    int station;   /* 'a' or 'b' */
+    int codec;     /* framing codec wanted, 0: any */
+    int port;      /* TCP port of the pair */
+};
+
+struct RELAY_REPLY {
+    int codec;     /* codec agreed on, -1: the stations disagree */
+    int bps[2];    /* A to B, B to A */
+    int delay[2];  /* ms */
+    long long epoch;
+};
+
+#define CODEC_NIBBLE 1
+
+/* bytes from one station, held until they have crossed the channel */
+struct CHUNK {
+    long long due;     /* delivery time (us) */
+    int len, pos;
+    struct CHUNK *link;
+    unsigned char data[MAX_CHUNK];
+};
+
+/* one direction of a pair, 0: A to B, 1: B to A */
+struct DIR {
+    struct CHUNK *head, *tail;
+    long long busy;    /* the channel is sending until then */
+    long long bytes, nbits;
+    long long gap;     /* channel bits up to the next bit error */
+    int noise, drops;
+    long long qdelay, qmax; /* time spent queued for the channel */
+    int chunks;
+};
+
+struct PAIR {
+    int port;
+    int sock[2];       /* station A, station B, -1: not connected */
+    int codec[2];
+    int wire_bits;     /* channel bits a wire byte costs under the codec */
+    int running;       /* both stations answered, forwarding */
+    long long t0;
+    struct DIR dir[2];
+};
+
+static struct PAIR pairs[MAX_PAIR];
+
+/* a connection whose hello is still coming in */
+struct PENDING {
+    int sock;          /* -1: free */
+    int len;           /* hello bytes received */
+    long long ts;
+    struct RELAY_HELLO h;
+};
+
+static struct PENDING pending[MAX_PENDING];
+
+static int bps[2] = { CHAN_BPS, CHAN_BPS };
+static int delay[2] = { CHAN_DELAY, CHAN_DELAY };
+static double ber = DEFAULT_CHAN_BER;
+static int queue_ms = 0; /* drop what would wait longer for the channel, 0: no limit */
+static unsigned short port = DEFAULT_RELAY_PORT;
+
+static long long now;
+
+/* "<a>" or "<a>:<b>", both at least 'min' */
+static int chan_pair(const char *s, int v[2], int min)
+{
+    char *end;
+
+    v[0] = v[1] = (int)strtol(s, &end, 10);
+    if (*end == ':')
+        v[1] = (int)strtol(end + 1, &end, 10);
+
+    return *end == 0 && v[0] >= min && v[1] >= min;
+}
+
+#define OPT_BPS   0x100
+#define OPT_DELAY 0x101
+#define OPT_QUEUE 0x102
+
+static struct option intopts[] = {
+	{ "help",	no_argument, NULL, '?' },
+	{ "utopia", no_argument, NULL, 'u' },
+	{ "port",	required_argument, NULL, 'p' },
+	{ "ber",	required_argument, NULL, 'b' },
+	{ "bps",    required_argument, NULL, OPT_BPS },
+	{ "delay",  required_argument, NULL, OPT_DELAY },
+	{ "queue",  required_argument, NULL, OPT_QUEUE },
+	{ 0, 0, 0, 0 },
+};
+
+static void config(int argc, char **argv)
+{
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "?up:b:", intopts, NULL)) != -1) {
+		switch (opt) {
+		case 'u':
+			ber = 0.0;
+			break;
+
+		case 'p':
+			port = (unsigned short)atoi(optarg);
+			break;
+
+		case 'b':
+			ber = strtod(optarg, 0);
+			if (ber < 0.0 || ber >= 1.0) {
+				printf("Bad bit error rate %s\n", optarg);
+				goto usage;
+			}
+			break;
+
+		case OPT_BPS:
+			if (!chan_pair(optarg, bps, 1)) {
+				printf("Bad bit rate %s\n", optarg);
+				goto usage;
+			}
+			break;
+
+		case OPT_DELAY:
+			if (!chan_pair(optarg, delay, 0)) {
+				printf("Bad delay %s\n", optarg);
+				goto usage;
+			}
+			break;
+
+		case OPT_QUEUE:
+			queue_ms = atoi(optarg);
+			if (queue_ms < 1) {
+				printf("Bad queue limit %s\n", optarg);
+				goto usage;
+			}
+			break;
+
+		default:
+		usage:
+			printf("\nUsage:\n  %s <options>\n", argv[0]);
+			printf(
+				"\nOptions : \n"
+				"    -?, --help : print this\n"
+				"    -p, --port=<port#> : TCP port the stations connect to (default: %u)\n"
+				"    -u, --utopia : no bit errors\n"
+				"    -b, --ber=<ber> : bit error rate (default: %.0E)\n"
+				"    --bps=<a>[:<b>] : channel bit rate, A to B and B to A (default: %d)\n"
+				"    --delay=<ms>[:<ms>] : propagation delay, A to B and B to A (default: %d)\n"
+				"    --queue=<ms> : drop the data that would wait longer than <ms> for the channel\n"
+				"\n"
+				"Start the stations with --relay[=<port>]; stations with the same -p make a pair.\n"
+				"\n",
+				DEFAULT_RELAY_PORT, DEFAULT_CHAN_BER, CHAN_BPS, CHAN_DELAY);
+			exit(0);
+		}
+	}
+}
+
+/* channel bits up to the next bit error, geometric with mean 1/ber */
+static long long noise_gap(void)
+{
+    double u = (rand() + 0.5) / (RAND_MAX + 1.0);
+
+    return (long long)(log(u) / log(1.0 - ber));
+}
+
+static void pair_report(struct PAIR *p)
+{
+    struct DIR *d;
+    int i;
+
+    printf("Pair %u closed after %.3f s\n", p->port, (now - p->t0) / 1000000.0);
+    for (i = 0; i < 2; i++) {
+        d = &p->dir[i];
+        printf("    %s: %lld bytes, %d bit errors (%.1E), %d chunks dropped, "
+            "queued %.3f ms avg, %.3f ms max\n", i == 0 ? "A->B" : "B->A",
+            d->bytes, d->noise, d->nbits ? (double)d->noise / d->nbits : 0.0, d->drops,
+            d->chunks ? d->qdelay / 1000.0 / d->chunks : 0.0, d->qmax / 1000.0);
+    }
+}
+
+static void pair_close(struct PAIR *p)
+{
+    struct CHUNK *c;
+    int i;
+
+    if (p->running)
+        pair_report(p);
+    for (i = 0; i < 2; i++) {
+        if (p->sock[i] >= 0)
+            close_socket(p->sock[i]);
+        while ((c = p->dir[i].head) != NULL) {
+            p->dir[i].head = c->link;
+            free(c);
+        }
+    }
+    memset(p, 0, sizeof(*p));
+    p->sock[0] = p->sock[1] = -1;
+}
+
+/* both stations are in: settle the codec like station A does and answer */
+static void pair_start(struct PAIR *p)
+{
+    struct RELAY_REPLY r;
+    int i;
+
+    r.codec = p->codec[1] ? p->codec[1] : p->codec[0] ? p->codec[0] : CODEC_NIBBLE;
+    if (p->codec[0] && p->codec[1] && p->codec[0] != p->codec[1])
+        r.codec = -1;
+    r.bps[0] = bps[0];
+    r.bps[1] = bps[1];
+    r.delay[0] = delay[0];
+    r.delay[1] = delay[1];
+    r.epoch = now;
+
+    for (i = 0; i < 2; i++)
+        send(p->sock[i], (char *)&r, sizeof(r), 0);
+    if (r.codec < 0) {
+        printf("Pair %u: the stations want different framing codecs\n", p->port);
+        pair_close(p);
+        return;
+    }
+
+    for (i = 0; i < 2; i++)
+        p->dir[i].gap = ber != 0.0 ? noise_gap() : 0;
+    p->wire_bits = r.codec == CODEC_NIBBLE ? 4 : 8;
+    p->running = 1;
+    p->t0 = now;
+    printf("Pair %u: running, codec %d\n", p->port, r.codec);
+}
+
+/* the station has said hello: join it to its pair */
+static void pair_join(int sock, struct RELAY_HELLO *hello)
+{
+    struct RELAY_HELLO h = *hello;
+    struct PAIR *p, *free_pair = NULL;
+    int s, i;
+
+    s = h.station == 'a' ? 0 : 1;
+
+    for (i = 0, p = NULL; i < MAX_PAIR; i++) {
+        if (pairs[i].port == h.port && !pairs[i].running && pairs[i].sock[s] < 0)
+            p = &pairs[i];
+        else if (pairs[i].port == 0 && free_pair == NULL)
+            free_pair = &pairs[i];
+    }
+    if (p == NULL && (p = free_pair) == NULL) {
+        printf("Station %c of pair %u: too many pairs\n", h.station - 'a' + 'A', h.port);
+        close_socket(sock);
+        return;
+    }
+
+    p->port = h.port;
+    p->sock[s] = sock;
+    p->codec[s] = h.codec;
+    printf("Station %c of pair %u connected\n", h.station - 'a' + 'A', h.port);
+    if (p->sock[1 - s] >= 0)
+        pair_start(p);
+}
+
+/* the hello is read by the select() loop, a silent client holds up nobody */
+static void relay_accept(int admin_sock)
+{
+    struct PENDING *c;
+    int sock, on = 1;
+
+    sock = (int)accept(admin_sock, 0, 0);
+    if (sock < 0)
+        return;
+    for (c = pending; c < pending + MAX_PENDING && c->sock >= 0; c++)
+        ;
+    if (c == pending + MAX_PENDING) {
+        printf("Dropped a connection, too many waiting for their hello\n");
+        close_socket(sock);
+        return;
+    }
+
+    set_nonblock(sock);
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on));
+    c->sock = sock;
+    c->len = 0;
+    c->ts = now;
+}
+
+static void hello_read(struct PENDING *c)
+{
+    int n;
+
+    n = recv(c->sock, (char *)&c->h + c->len, sizeof(c->h) - c->len, 0);
+    if (n < 0 && sock_errno() == SOCK_AGAIN)
+        return;
+    if (n > 0 && (c->len += n) < (int)sizeof(c->h))
+        return;
+
+    if (n <= 0 || c->h.magic != RELAY_MAGIC || (c->h.station != 'a' && c->h.station != 'b')) {
+        printf("Dropped a connection without a station hello\n");
+        close_socket(c->sock);
+    } else
+        pair_join(c->sock, &c->h);
+    c->sock = -1;
+}
+
+/* bytes from station 'i' enter the channel, or the queue is full */
+static int relay_read(struct PAIR *p, int i)
+{
+    struct DIR *d = &p->dir[i];
+    struct CHUNK *c = (struct CHUNK *)malloc(sizeof(struct CHUNK));
+    long long start, bits;
+    unsigned char *b;
+    int n;
+
+    if (c == NULL)
+        return 0;
+    n = recv(p->sock[i], (char *)c->data, MAX_CHUNK, 0);
+    if (n <= 0) {
+        free(c);
+        return n < 0 && sock_errno() == SOCK_AGAIN;
+    }
+    c->len = n;
+    d->bytes += c->len;
+
+    start = d->busy > now ? d->busy : now;
+    if (queue_ms && start - now > queue_ms * 1000LL) {
+        d->drops++;
+        free(c);
+        return 1;
+    }
+    d->qdelay += start - now;
+    if (start - now > d->qmax)
+        d->qmax = start - now;
+    d->chunks++;
+    d->busy = start + c->len * p->wire_bits * 1000000LL / bps[i];
+    /* as early as a station commits what it receives, to make up for its tick */
+    c->due = d->busy + delay[i] * 1000LL - (delay[i] < 40 ? delay[i] / 4 : 10) * 1000LL;
+
+    /* 
+       Bit errors land on the channel bits they fall on, whatever pieces TCP
+       cut the stream into. Like a station, spare the nibble wire bytes with
+       a clear low half; their error moves on to the next wire byte.
+    */
+    bits = (long long)c->len * p->wire_bits;
+    d->nbits += bits;
+    if (ber != 0.0) {
+        while (d->gap < bits) {
+            b = &c->data[d->gap / p->wire_bits];
+            if ((*b & 0x0f) == 0 && p->wire_bits == 4) {
+                d->gap += p->wire_bits;
+                continue;
+            }
+            *b ^= 1 << (rand() % 8);
+            d->noise++;
+            d->gap += noise_gap() + 1;
+        }
+        d->gap -= bits;
+    }
+
+    c->pos = 0;
+    c->link = NULL;
+    if (d->head == NULL)
+        d->head = d->tail = c;
+    else {
+        d->tail->link = c;
+        d->tail = c;
+    }
+    return 1;
+}
+
+/* deliver what has crossed the channel from station 'i', 0: the peer is gone */
+static int relay_write(struct PAIR *p, int i)
+{
+    struct DIR *d = &p->dir[i];
+    struct CHUNK *c;
+    int n;
+
+    while ((c = d->head) != NULL && c->due <= now) {
+        n = send(p->sock[1 - i], (char *)c->data + c->pos, c->len - c->pos, 0);
+        if (n < 0)
+            return sock_errno() == SOCK_AGAIN;
+        c->pos += n;
+        if (c->pos < c->len)
+            return 1;
+        d->head = c->link;
+        free(c);
+    }
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_in name;
+    struct timeval tv;
+    fd_set rset, wset;
+    struct PAIR *p;
+    long long next;
+    int admin_sock, maxfd, i, s, on = 1;
+
+    socket_init();
+    setvbuf(stdout, NULL, _IONBF, 0);
+    config(argc, argv);
+    srand(0x098bcde1);
+    for (i = 0; i < MAX_PAIR; i++)
+        pairs[i].sock[0] = pairs[i].sock[1] = -1;
+    for (i = 0; i < MAX_PENDING; i++)
+        pending[i].sock = -1;
+
+    name.sin_family = AF_INET;
+    name.sin_addr.s_addr = inet_addr("127.0.0.1");
+    name.sin_port = htons(port);
+
+    admin_sock = (int)socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    setsockopt(admin_sock, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on));
+    if (admin_sock < 0 || bind(admin_sock, (struct sockaddr *)&name, sizeof(name)) < 0) {
+        printf("Failed to bind TCP port %u\n", port);
+        return 1;
+    }
+    listen(admin_sock, 16);
+
+    printf("Channel: A->B %d bps %d ms, B->A %d bps %d ms, bit error rate %.1E",
+        bps[0], delay[0], bps[1], delay[1], ber);
+    if (queue_ms)
+        printf(", queue limit %d ms", queue_ms);
+    printf("\nWaiting for stations on TCP port %u\n", port);
+
+    for (;;) {
+        FD_ZERO(&rset);
+        FD_ZERO(&wset);
+        FD_SET(admin_sock, &rset);
+        maxfd = admin_sock;
+        now = monotonic_us();
+        next = now + 1000000;
+
+        for (i = 0; i < MAX_PENDING; i++) {
+            if (pending[i].sock < 0)
+                continue;
+            FD_SET(pending[i].sock, &rset);
+            if (pending[i].sock > maxfd)
+                maxfd = pending[i].sock;
+        }
+
+        for (p = pairs; p < pairs + MAX_PAIR; p++) {
+            for (s = 0; s < 2; s++) {
+                if (p->sock[s] < 0)
+                    continue;
+                FD_SET(p->sock[s], &rset);
+                if (p->sock[s] > maxfd)
+                    maxfd = p->sock[s];
+                if (p->dir[s].head == NULL)
+                    continue;
+                if (p->dir[s].head->due <= now)
+                    FD_SET(p->sock[1 - s], &wset); /* the peer did not take it all */
+                else if (p->dir[s].head->due < next)
+                    next = p->dir[s].head->due;
+            }
+        }
+
+        tv.tv_sec = (long)((next - now) / 1000000);
+        tv.tv_usec = (long)((next - now) % 1000000);
+        if (select(maxfd + 1, &rset, &wset, NULL, &tv) < 0)
+            continue;
+        now = monotonic_us();
+
+        for (p = pairs; p < pairs + MAX_PAIR; p++) {
+            for (s = 0; s < 2 && p->running; s++) {
+                if (FD_ISSET(p->sock[s], &rset) && !relay_read(p, s)) {
+                    printf("Station %c of pair %u disconnected\n", 'A' + s, p->port);
+                    pair_close(p);
+                } else if (!relay_write(p, s)) {
+                    printf("Station %c of pair %u disconnected\n", 'B' - s, p->port);
+                    pair_close(p);
+                }
+            }
+            /* a station waiting for its peer may give up */
+            for (s = 0; s < 2 && p->port && !p->running; s++) {
+                if (p->sock[s] >= 0 && FD_ISSET(p->sock[s], &rset)) {
+                    printf("Station %c of pair %u left before its peer came\n", 'A' + s, p->port);
+                    pair_close(p);
+                }
+            }
+        }
+
+        /* after the pairs: a station joining now has not been selected for as one */
+        for (i = 0; i < MAX_PENDING; i++) {
+            if (pending[i].sock < 0)
+                continue;
+            if (FD_ISSET(pending[i].sock, &rset))
+                hello_read(&pending[i]);
+            else if (now - pending[i].ts > HELLO_TIMEOUT * 1000000LL) {
+                printf("Dropped a connection, no hello in %d s\n", HELLO_TIMEOUT);
+                close_socket(pending[i].sock);
+                pending[i].sock = -1;
+            }
+        }
+
+        if (FD_ISSET(admin_sock, &rset))
+            relay_accept(admin_sock);
+    }
+
+    return 0;
+}
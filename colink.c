@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "colink.h"
+
+#define ABORT(s) do { lprintf("\nFATAL: %s\nAbort.\n", s); exit(0); } while(0)
+
+void co_spawn(struct co_link *link, struct co_task *t, int (*fn)(struct co_task *t), int ntimer)
+{
+    if (link->ntask == CO_MAX_TASKS)
+        ABORT("co_spawn(): too many tasks");
+
+    t->fn = fn;
+    t->link = link;
+    t->line = 0;
+    t->wait = 0;
+    t->event = t->arg = 0;
+    t->timer_base = link->ntimer;
+    t->ntimer = ntimer;
+    link->ntimer += ntimer;
+    link->task[link->ntask++] = t;
+}
+
+static void co_resume(struct co_task *t, int event, int arg)
+{
+    t->wait = 0;
+    t->event = event;
+    t->arg = arg;
+    t->fn(t);
+}
+
+/* resume every task waiting for 'event' */
+static void co_wake_all(struct co_link *link, int event)
+{
+    int i;
+
+    for (i = 0; i < link->ntask; i++) {
+        if (link->task[i]->wait & event)
+            co_resume(link->task[i], event, 0);
+    }
+}
+
+/* resume waiting tasks one by one while the condition still holds */
+static void co_wake_while(struct co_link *link, int event, int *cond)
+{
+    int i;
+
+    for (i = 0; i < link->ntask && *cond; i++) {
+        if (link->task[i]->wait & event)
+            co_resume(link->task[i], event, 0);
+    }
+}
+
+static void co_timeout(struct co_link *link, int nr)
+{
+    struct co_task *t;
+    int i;
+
+    for (i = 0; i < link->ntask; i++) {
+        t = link->task[i];
+        if (nr < t->timer_base || nr >= t->timer_base + t->ntimer)
+            continue;
+        /* a timeout nobody waits for is dropped, like an unhandled event */
+        if ((t->wait & CO_TIMEOUT) && (t->timer < 0 || t->timer == nr - t->timer_base))
+            co_resume(t, CO_TIMEOUT, nr - t->timer_base);
+        return;
+    }
+}
+
+static void co_dispatch(struct co_link *link, struct event *ev)
+{
+    switch (ev->type) {
+    case FRAME_RECEIVED:
+        link->len = recv_frame_crc(link->frame, sizeof(link->frame), &link->crc_ok);
+        co_wake_all(link, CO_FRAME);
+        break;
+
+    case PHYSICAL_LAYER_READY:
+        link->writable = 1;
+        co_wake_while(link, CO_WRITABLE, &link->writable);
+        break;
+
+    case NETWORK_LAYER_READY:
+        link->packet = 1;
+        co_wake_while(link, CO_PACKET, &link->packet);
+        break;
+
+    case DATA_TIMEOUT:
+        co_timeout(link, ev->arg);
+        break;
+    }
+}
+
+void co_run(struct co_link *link)
+{
+    struct event evs[MAX_EVENTS];
+    int i, n, alive, want_packet;
+
+    /* run every task up to its first await */
+    for (i = 0; i < link->ntask; i++)
+        co_resume(link->task[i], 0, 0);
+
+    for (;;) {
+        alive = want_packet = 0;
+        for (i = 0; i < link->ntask; i++) {
+            if (link->task[i]->line >= 0)
+                alive++;
+            if (link->task[i]->wait & CO_PACKET)
+                want_packet = 1;
+        }
+        if (alive == 0)
+            return;
+
+        if (want_packet && !link->packet)
+            enable_network_layer();
+        else
+            disable_network_layer();
+
+        n = wait_for_events(evs, MAX_EVENTS);
+        for (i = 0; i < n; i++)
+            co_dispatch(link, &evs[i]);
+    }
+}
+
+void co_send_frame(struct co_task *t, unsigned char *frame, int len)
+{
+    send_frame(frame, len);
+    t->link->writable = 0;
+}
+
+void co_send_frame_crc(struct co_task *t, unsigned char *frame, int len)
+{
+    send_frame_crc(frame, len);
+    t->link->writable = 0;
+}
+
+int co_get_packet(struct co_task *t, unsigned char *packet)
+{
+    t->link->packet = 0;
+    return get_packet(packet);
+}
+
+void co_start_timer(struct co_task *t, int nr, unsigned int ms)
+{
+    if (nr < 0 || nr >= t->ntimer)
+        ABORT("co_start_timer(): timer No. out of the task's range");
+    start_timer(t->timer_base + nr, ms);
+}
+
+void co_stop_timer(struct co_task *t, int nr)
+{
+    if (nr >= 0 && nr < t->ntimer)
+        stop_timer(t->timer_base + nr);
+}
@@ -0,0 +1,109 @@
+#ifndef __COLINK_H__
+#define __COLINK_H__
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#include "protocol.h"
+
+/*
+    Coroutine layer on top of the protocol.c event engine.
+
+    A sender or receiver is written as a straight-line task instead of a
+    'for(;;) switch(event)' state machine:
+
+        static int sender(struct co_task *t)
+        {
+            struct my_sender *s = (struct my_sender *)t;
+
+            co_begin(t);
+            for (;;) {
+                co_await_packet(t);
+                co_get_packet(t, s->buffer);
+                ...
+                co_await(t, CO_FRAME | CO_TIMEOUT);
+                if (t->event == CO_TIMEOUT) ...
+            }
+            co_end(t);
+        }
+
+    Tasks are stackless (Duff's device): locals do not survive an await, so
+    keep state in the structure embedding 'struct co_task', never await
+    from inside a 'switch' of the task body and put at most one await on a
+    source line. Awaiting costs no allocation; the scheduler resumes the
+    waiting tasks straight from wait_for_events().
+
+    Every task owns a private range of timer numbers, so several independent
+    senders and receivers can share one link.
+*/
+
+/* what a task is waiting for (bit mask) */
+#define CO_FRAME    0x01   /* a frame was received: t->link->frame, len, crc_ok */
+#define CO_TIMEOUT  0x02   /* one of the task's timers expired: t->arg */
+#define CO_WRITABLE 0x04   /* physical layer is ready for more frames */
+#define CO_PACKET   0x08   /* network layer has a packet for co_get_packet() */
+
+#define CO_MAX_TASKS 16
+
+struct co_link;
+
+struct co_task {
+    int (*fn)(struct co_task *t);
+    struct co_link *link;
+    int line;      /* resume point, -1 when finished */
+    int wait;      /* CO_xxx mask the task is suspended on */
+    int timer;     /* CO_TIMEOUT: task timer awaited, -1 for any */
+    int event;     /* CO_xxx that resumed the task */
+    int arg;       /* timer number for CO_TIMEOUT */
+    int timer_base, ntimer;
+};
+
+struct co_link {
+    struct co_task *task[CO_MAX_TASKS];
+    int ntask;
+    int ntimer;      /* timer numbers handed out so far */
+    int writable;    /* physical layer ready, cleared by co_send_frame() */
+    int packet;      /* network layer ready, cleared by co_get_packet() */
+    int len, crc_ok; /* last received frame */
+    unsigned char frame[PKT_LEN + 16];
+};
+
+#define co_begin(t)  switch ((t)->line) { case 0:
+#define co_end(t)    } (t)->line = -1; return 0
+
+#define co_suspend(t, mask, nr) do {                           \
+        (t)->wait = (mask); (t)->timer = (nr);                 \
+        (t)->line = __LINE__; return 1; case __LINE__:;        \
+    } while (0)
+
+#define co_await(t, mask)         co_suspend(t, mask, -1)
+#define co_await_frame(t)         co_suspend(t, CO_FRAME, -1)
+#define co_await_timeout(t, nr)   co_suspend(t, CO_TIMEOUT, nr)
+#define co_await_packet(t) do {                                \
+        if (!(t)->link->packet)                                \
+            co_suspend(t, CO_PACKET, -1);                      \
+    } while (0)
+#define co_await_writable(t) do {                              \
+        if (!(t)->link->writable)                              \
+            co_suspend(t, CO_WRITABLE, -1);                    \
+    } while (0)
+
+/* register a task using timer numbers 0..ntimer-1 of its own */
+extern void co_spawn(struct co_link *link, struct co_task *t,
+                     int (*fn)(struct co_task *t), int ntimer);
+
+/* run all tasks of the link until every one has finished */
+extern void co_run(struct co_link *link);
+
+extern void co_send_frame(struct co_task *t, unsigned char *frame, int len);
+extern void co_send_frame_crc(struct co_task *t, unsigned char *frame, int len);
+extern int  co_get_packet(struct co_task *t, unsigned char *packet);
+extern void co_start_timer(struct co_task *t, int nr, unsigned int ms);
+extern void co_stop_timer(struct co_task *t, int nr);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif
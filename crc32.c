@@ -64,10 +64,8 @@ static const unsigned int crc_table[256] = {
 #define DO4(buf)  DO2(buf); DO2(buf);
 #define DO8(buf)  DO4(buf); DO4(buf);
 
-unsigned int crc32(unsigned char *buf, int len)
+unsigned int crc32_update(unsigned int crc, const unsigned char *buf, int len)
 {
-    unsigned int crc = 0xffffffffL;
-
     while (len >= 8) {
         DO8(buf);
         len -= 8;
@@ -82,6 +80,11 @@ unsigned int crc32(unsigned char *buf, int len)
     return crc;
 }
 
+unsigned int crc32(unsigned char *buf, int len)
+{
+    return crc32_update(0xffffffffL, buf, len);
+}
+
 #if 0
 
 #include <stdio.h>
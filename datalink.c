@@ -20,8 +20,7 @@ static int phl_ready = 0;
 
 static void put_frame(unsigned char *frame, int len)
 {
-    *(unsigned int *)(frame + len) = crc32(frame, len);
-    send_frame(frame, len + 4);
+    send_frame_crc(frame, len);
     phl_ready = 0;
 }
 
@@ -56,7 +55,7 @@ int main(int argc, char **argv)
 {
     int event, arg;
     struct FRAME f;
-    int len = 0;
+    int len = 0, crc_ok;
 
     protocol_init(argc, argv); 
     lprintf("Designed by Jiang Yanjun, build: " __DATE__"  "__TIME__"\n");
@@ -78,8 +77,8 @@ int main(int argc, char **argv)
             break;
 
         case FRAME_RECEIVED: 
-            len = recv_frame((unsigned char *)&f, sizeof f);
-            if (len < 5 || crc32((unsigned char *)&f, len) != 0) {
+            len = recv_frame_crc((unsigned char *)&f, sizeof f, &crc_ok);
+            if (!crc_ok) {
                 dbg_event("**** Receiver Error, Bad CRC Checksum\n");
                 break;
             }
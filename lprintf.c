@@ -36,6 +36,14 @@ static unsigned long skip_to(const char *format) {
     return i;
 }
 
+#ifdef _WIN32
+#define log_lock()   _lock_file(stdout)
+#define log_unlock() _unlock_file(stdout)
+#else
+#define log_lock()   flockfile(stdout)
+#define log_unlock() funlockfile(stdout)
+#endif
+
 #define tee_output(buf, len) do { \
     fwrite(buf, 1, len, stdout); \
 	if (log_file)                    \
@@ -45,15 +53,16 @@ static unsigned long skip_to(const char *format) {
 static int output(const char *str, int len)
 {
 	static bool sol = true; /* start of line */
-	unsigned int ms, n;
+	__int64 us;
+	unsigned int n;
 	char timestamp[32];
 	const char *head, *tail, *end = str + len;
 
 	for (head = tail = str; tail < end; head = tail) {
 		while (tail < end && *tail++ != '\n');
 		if (sol) {
-			ms = get_ms();
-			n = sprintf(timestamp, "%03d.%03d ", ms / 1000, ms % 1000);
+			us = get_us();
+			n = sprintf(timestamp, "%03u.%06u ", (unsigned int)(us / 1000000), (unsigned int)(us % 1000000));
 			tee_output(timestamp, n);
 		}
 		tee_output(head, tail - head);
@@ -361,7 +370,7 @@ static int output_memory_block(const unsigned char *ptr, int n,
     return len;
 }
 
-int __v_lprintf(const char *format, va_list arg_ptr)
+static int v_lprintf(const char *format, va_list arg_ptr)
 {
     unsigned int len = 0;
     int err = errno;
@@ -569,6 +578,17 @@ print_num:
     return len;
 }
 
+/* one message at a time: the I/O thread of --threads logs too */
+int __v_lprintf(const char *format, va_list arg_ptr)
+{
+    int n;
+
+    log_lock();
+    n = v_lprintf(format, arg_ptr);
+    log_unlock();
+    return n;
+}
+
 int lprintf(const char *format,...)
 {
     int n;
@@ -10,6 +10,7 @@ extern "C"
 
 extern FILE *log_file;
 extern unsigned int get_ms(void);
+extern long long get_us(void);
 
 int lprintf(const char *format, ...);
 int __v_lprintf(const char *format, va_list arg_ptr);
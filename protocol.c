@@ -2,9 +2,18 @@
 #define _CRT_SECURE_NO_WARNINGS
 #endif
 
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* sched_setaffinity() */
+#endif
+
 #include <time.h>
 
-static time_t epoch; /* epoch timestamp (be same for Station A & B) */
+/* 
+   epoch in microseconds of the monotonic clock (be same for Station A & B). 
+   Both stations always run on the same host (B connects to 127.0.0.1), so
+   they share one monotonic clock and B's reading can be used verbatim by A. 
+*/
+static long long epoch;
 
 #ifdef _WIN32 /* for Windows Visual Studio */
 
@@ -17,6 +26,7 @@ static time_t epoch; /* epoch timestamp (be same for Station A & B) */
 
 #define getopt_long getopt_int
 #define stricmp _stricmp
+#define strnicmp _strnicmp
 
 static void socket_init(void)
 {
@@ -32,13 +42,16 @@ static void socket_init(void)
     }
 }
 
-unsigned int get_ms(void)
+static long long monotonic_us(void)
 {
-	struct _timeb tm;
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER cnt;
 
-	_ftime(&tm);
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&cnt);
 
-	return (unsigned int)(epoch ? (tm.time - epoch) * 1000 + tm.millitm : 0);
+	return cnt.QuadPart / freq.QuadPart * 1000000 + cnt.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart;
 }
 
 #pragma comment(lib,"wsock32.lib")
@@ -56,35 +69,80 @@ unsigned int get_ms(void)
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include <netdb.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <signal.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <pthread.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
 #define stricmp strcasecmp
+#define strnicmp strncasecmp
 #define Sleep(ms) usleep((ms) * 1000)
 #define socket_init()
 
-unsigned int get_ms(void)
+static long long monotonic_us(void)
 {
-	struct timeval tm;
-	struct timezone tz;
+	struct timespec tm;
 
-	gettimeofday(&tm, &tz);
+	clock_gettime(CLOCK_MONOTONIC, &tm);
 
-	return (unsigned int)(epoch ? (tm.tv_sec - epoch) * 1000 + tm.tv_usec / 1000 : 0);
+	return (long long)tm.tv_sec * 1000000 + tm.tv_nsec / 1000;
 }
 
 #endif
 
 #include <math.h>
 
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET(isa)
+#else
+#define TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
 #include "protocol.h"
 
-/* channel parameters */
+/* default channel parameters, see --bps, --delay and --schedule */
 #define CHAN_DELAY 270       /* ms */
 #define CHAN_BPS   8000      /* bits per second */
+#define STRESS_BPS 1000000000 /* --stress: nominal rate for the timer and network layer arithmetic */
 
 #define ABORT(s) do { lprintf("\nFATAL: %s\nAbort.\n", s); exit(0); } while(0)
 
 #define DEFAULT_TICK 15 /* ms */
 #define DEFAULT_CHAN_BER   1.0E-5    /* Bit Error Rate */
 #define DEFAULT_PORT  59144
+#define DEFAULT_RELAY_PORT 59145 /* chanemu */
+#define DEFAULT_BURST 16 /* wire bytes */
+#define DEFAULT_SPIN  200 /* us */
+#define DEFAULT_AQM_TARGET   500  /* ms, above the wire time of a full frame at 8000 bps */
+#define DEFAULT_AQM_INTERVAL 2000 /* ms, a round trip with a full window in flight */
+
+#define MAX_BOND 8
+
+#define DEFAULT_LANE 8 /* frame bytes, ACK and NAK frames of the protocols are 2 or 3 */
+
+#define AQM_DROP 1
+#define AQM_MARK 2
 
 #define NMAGIC     32
 #define HEAD_MAGIC 0xa5a5e41b
@@ -101,45 +159,322 @@ static double ber = DEFAULT_CHAN_BER;  /* Bit Error Rate */
 static int mode_ibib = 0;    /* 0: BUSY-IDLE-BUSY-..., 1: IDLE-BUSY-BUSY-... */
 static int mode_flood = 0;   /* flood mode */
 static int mode_cycle = 100;  /* seconds */
-static int mode_life = 0x7fffff00;
+static long long mode_life = 0x7fffff00 * 1000LL; /* us */
 static int mode_tick = DEFAULT_TICK;
 static int mode_seed = 0x098bcde1;
+static int mode_burst = DEFAULT_BURST;
+static int mode_wait = 0;    /* block until the next deadline instead of polling every tick */
+static int mode_spin = 0;    /* busy-poll the last 'mode_spin' us before a deadline */
+static int mode_cpu = -1;    /* pin the station to this CPU */
+static int mode_sim = 0;     /* virtual-time simulation */
+static int mode_launch = 0;  /* launcher: run this many A/B pairs over socketpair()s */
+static int mode_fd = -1;     /* connected link inherited from the launcher */
+static int mode_pool = -1;   /* objects preallocated per receive pool, -1: no pool report */
+static int mode_shm = 0;     /* shared-memory rings instead of a socket */
+static int mode_uring = 0;   /* drive the socket through io_uring */
+static int mode_codec = 0;   /* framing codec asked for, 0: whatever the peer wants */
+static int mode_stress = 0;  /* unpaced, undelayed flood, report the CPU cost per packet */
+static int mode_threads = 0; /* physical layer on an I/O thread of its own */
+static int mode_aqm = 0;     /* AQM_DROP or AQM_MARK: CoDel on the sending queue */
+static int aqm_target = DEFAULT_AQM_TARGET, aqm_interval = DEFAULT_AQM_INTERVAL; /* ms */
+static int mode_lane = 0;    /* frames up to this many bytes jump the queued data frames, 0: FIFO */
+static int mode_bond = 1;    /* member channels of the link */
+static int bond_skew = 0;    /* ms each member is slower than the one before */
+static int bond_cur = 0;     /* member the physical layer works on */
+static int mode_relay = 0;   /* TCP port of the chanemu relay, 0: no relay */
 static int debug_mask = 0; /* debug mask */
 static unsigned short port = DEFAULT_PORT;
 
 static int sock;
-static int now; /* timestamp (ms) */
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+static THREAD_LOCAL long long now; /* timestamp (us), the I/O thread of --threads keeps its own */
 static int noise = 0; /* counter of bit errors */
+static int wire_bits = 4; /* channel bits one wire byte costs under the framing codec */
+static THREAD_LOCAL unsigned int nsyscalls; /* system calls made moving frames and waiting, for --stress */
+static volatile unsigned int io_nsyscalls;     /* ... by the I/O thread of --threads */
+static volatile int io_down; /* the I/O thread of --threads lost the link and returned */
+
+#define SYSCALL(call) (nsyscalls++, (call))
+
+static long long sim_now; /* virtual clock (us) in --sim mode */
+static FILE *record_file, *replay_file;
+
+long long get_us(void)
+{
+	if (mode_sim)
+		return sim_now;
+	if (replay_file)
+		return now; /* recorded time of the current event batch */
+	return epoch ? monotonic_us() - epoch : 0;
+}
+
+unsigned int get_ms(void)
+{
+	return (unsigned int)(get_us() / 1000);
+}
 
 char *station_name(void)
 {
     return (char *)(station == 'a' ? "A" : station == 'b' ? "B" : "XXX");
 }
 
+/* 
+   Channel Model 
+
+   Bit rate and propagation delay of each direction (0: A to B, 1: B to A),
+   as a list of steps in time. Step 0 holds --bps/--delay from time 0, a
+   --schedule file adds later ones, one per line:
+
+       # seconds  changes (a single value sets both directions)
+       60         bps=64000 delay=20
+       120        bps=8000:1200 delay=600:270
+
+   A station paces what it sends at the rate of its outgoing direction and
+   holds what it receives for the delay of the incoming one, both taken at
+   the time the bytes were sent.
+*/
+
+#define MAX_CHAN_STEP 256
+
+struct CHAN_STEP {
+    long long ts;  /* us */
+    int bps[2];
+    int delay[2];  /* ms */
+};
+
+static struct CHAN_STEP chan[MAX_CHAN_STEP] = { { 0, { CHAN_BPS, CHAN_BPS }, { CHAN_DELAY, CHAN_DELAY } } };
+static int chan_nstep = 1;
+static int blk_size;  /* receive block size, follows the fastest incoming rate */
+
+#define chan_out() (station == 'a' ? 0 : 1)
+#define chan_in()  (station == 'a' ? 1 : 0)
+
+/* step in effect at 'ts' */
+static struct CHAN_STEP *chan_at(long long ts)
+{
+    int i = chan_nstep - 1;
+
+    while (i > 0 && chan[i].ts > ts)
+        i--;
+    return &chan[i];
+}
+
+static int chan_bps(int dir)
+{
+    return chan_at(now)->bps[dir];
+}
+
+/* time the next step takes effect, 0 if none */
+static long long chan_next(void)
+{
+    struct CHAN_STEP *c = chan_at(now);
+
+    return c + 1 < chan + chan_nstep ? c[1].ts : 0;
+}
+
+/* bits (times 1000000) the direction carries between t0 and t1 */
+static long long chan_bits(int dir, long long t0, long long t1)
+{
+    struct CHAN_STEP *c = chan_at(t0);
+    long long sum = 0, end;
+
+    for (; t0 < t1; t0 = end, c++) {
+        end = c + 1 < chan + chan_nstep && c[1].ts < t1 ? c[1].ts : t1;
+        sum += (end - t0) * c->bps[dir];
+    }
+    return sum;
+}
+
+/* 
+   How early received bytes are committed before the full delay (us): 10 ms 
+   of slack for the tick, less on short links so that the delay stays 
+   positive, which is also the look-ahead of --sim.
+*/
+static long long chan_early(int delay)
+{
+    return (delay < 40 ? delay / 4 : 10) * 1000LL;
+}
+
+static long long chan_delay(int dir, long long ts)
+{
+    int d = chan_at(ts)->delay[dir];
+
+    if (mode_relay)
+        return 0; /* the relay held the bytes already */
+    return d * 1000LL - chan_early(d);
+}
+
+/* the shortest delay of the direction from 'ts' on */
+static long long chan_min_delay(int dir, long long ts)
+{
+    struct CHAN_STEP *c = chan_at(ts);
+    long long d, min = chan_delay(dir, ts);
+
+    for (c++; c < chan + chan_nstep; c++) {
+        d = c->delay[dir] * 1000LL - chan_early(c->delay[dir]);
+        if (d < min)
+            min = d;
+    }
+    return min;
+}
+
+/* "<a>" or "<a>:<b>", both at least 'min' */
+static int chan_pair(const char *s, int v[2], int min)
+{
+    char *end;
+
+    v[0] = v[1] = (int)strtol(s, &end, 10);
+    if (*end == ':')
+        v[1] = (int)strtol(end + 1, &end, 10);
+
+    return *end == 0 && v[0] >= min && v[1] >= min;
+}
+
+static void chan_load(const char *fname)
+{
+    FILE *fp;
+    char line[256], *p, msg[300];
+    double t;
+    int n, lineno = 0;
+    struct CHAN_STEP *c;
+
+    if ((fp = fopen(fname, "r")) == NULL) {
+        sprintf(msg, "Failed to open schedule file \"%.200s\"", fname);
+        ABORT(msg);
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+        if ((p = strchr(line, '#')) != NULL)
+            *p = 0;
+        if ((p = strtok(line, " \t\r\n")) == NULL)
+            continue;
+
+        if (chan_nstep == MAX_CHAN_STEP)
+            ABORT("Too many steps in the schedule file");
+        c = &chan[chan_nstep];
+        *c = c[-1];
+        t = strtod(p, &p);
+        c->ts = (long long)(t * 1000000);
+        n = *p == 0 && c->ts > c[-1].ts;
+
+        while (n && (p = strtok(NULL, " \t\r\n")) != NULL) {
+            if (strncmp(p, "bps=", 4) == 0)
+                n = chan_pair(p + 4, c->bps, 1);
+            else if (strncmp(p, "delay=", 6) == 0)
+                n = chan_pair(p + 6, c->delay, 1);
+            else
+                n = 0;
+        }
+        if (!n) {
+            sprintf(msg, "Schedule file \"%.200s\", line %d: bad step (times must increase, rates and delays be positive)", fname, lineno);
+            ABORT(msg);
+        }
+        chan_nstep++;
+    }
+
+    fclose(fp);
+}
+
+static void chan_setup(const char *schedule)
+{
+    int i, max = 0;
+
+    if (schedule)
+        chan_load(schedule);
+
+    if (mode_stress) {
+        for (i = 0; i < chan_nstep; i++) {
+            chan[i].bps[0] = chan[i].bps[1] = STRESS_BPS;
+            chan[i].delay[0] = chan[i].delay[1] = 0;
+        }
+    }
+
+    for (i = 0; i < chan_nstep; i++) {
+        if (chan[i].bps[chan_in()] > max)
+            max = chan[i].bps[chan_in()];
+    }
+    blk_size = 16 * max / 8 / (1000 / DEFAULT_TICK);
+    if (blk_size < 64)
+        blk_size = 64;
+    if (blk_size > 65536)
+        blk_size = 65536;
+}
+
+/* long-only options */
+#define OPT_BURST   0x100
+#define OPT_PRECISE 0x101
+#define OPT_CPU     0x102
+#define OPT_RECORD  0x103
+#define OPT_REPLAY  0x104
+#define OPT_LAUNCH  0x105
+#define OPT_FD      0x106
+#define OPT_POOL    0x107
+#define OPT_TRANSPORT 0x108
+#define OPT_CODEC   0x109
+#define OPT_BPS     0x10a
+#define OPT_DELAY   0x10b
+#define OPT_SCHEDULE 0x10c
+#define OPT_STRESS  0x10d
+#define OPT_THREADS 0x10e
+#define OPT_AQM     0x10f
+#define OPT_LANE    0x110
+#define OPT_BOND    0x111
+#define OPT_RELAY   0x112
+
 static struct option intopts[] = {
 	{ "help",	no_argument, NULL, '?' },
 	{ "utopia", no_argument, NULL, 'u' },
 	{ "flood",	no_argument, NULL, 'f' },
 	{ "ibib",	no_argument, NULL, 'i' },
 	{ "nolog",  no_argument, NULL, 'n' },
+	{ "wait",   no_argument, NULL, 'w' },
+	{ "sim",    no_argument, NULL, 's' },
 	{ "debug",	required_argument, NULL, 'd' },
 	{ "port",	required_argument, NULL, 'p' },
 	{ "ber",	required_argument, NULL, 'b' },
 	{ "log",	required_argument, NULL, 'l' },
 	{ "ttl",    required_argument, NULL, 't' },
+	{ "burst",  required_argument, NULL, OPT_BURST },
+	{ "precise", optional_argument, NULL, OPT_PRECISE },
+	{ "cpu",    required_argument, NULL, OPT_CPU },
+	{ "record", required_argument, NULL, OPT_RECORD },
+	{ "replay", required_argument, NULL, OPT_REPLAY },
+	{ "launch", optional_argument, NULL, OPT_LAUNCH },
+	{ "fd",     required_argument, NULL, OPT_FD },
+	{ "pool",   optional_argument, NULL, OPT_POOL },
+	{ "transport", required_argument, NULL, OPT_TRANSPORT },
+	{ "codec",  required_argument, NULL, OPT_CODEC },
+	{ "bps",    required_argument, NULL, OPT_BPS },
+	{ "delay",  required_argument, NULL, OPT_DELAY },
+	{ "schedule", required_argument, NULL, OPT_SCHEDULE },
+	{ "stress", no_argument, NULL, OPT_STRESS },
+	{ "threads", no_argument, NULL, OPT_THREADS },
+	{ "aqm",    optional_argument, NULL, OPT_AQM },
+	{ "ctrl-lane", optional_argument, NULL, OPT_LANE },
+	{ "bond",   required_argument, NULL, OPT_BOND },
+	{ "relay",  optional_argument, NULL, OPT_RELAY },
 	{ 0, 0, 0, 0 },
 };
 
-#define OPT_SHORT "?ufind:p:b:l:t:"
+#define OPT_SHORT "?ufinwsd:p:b:l:t:"
+
+static void launch(int argc, char **argv);
+static int  codec_id(const char *name);
 
 static void config(int argc, char **argv)
 {
-	char fname[1024];
+	char fname[1024], rname[1024], *schedule = NULL;
 	int   i, opt;
 
 	if (argc < 2) {
 	usage:
-		printf("\nUsage:\n  %s <options> <station-name>\n", argv[0]);
+		printf("\nUsage:\n  %s <options> <station-name>\n  %s --launch[=<runs>] <options>\n", argv[0], argv[0]);
 		printf(
 			"\nOptions : \n"
 			"    -?, --help : print this\n"
@@ -147,17 +482,48 @@ static void config(int argc, char **argv)
 			"    -f, --flood : flood traffic\n"
 			"    -i, --ibib  : set station B layer 3 sender mode as IDLE-BUSY-IDLE-BUSY-...\n"
 			"    -n, --nolog : do not create log file\n"
+			"    -w, --wait : sleep until the next timer/frame/sending deadline, not every tick\n"
+			"    -s, --sim : run in virtual time, jumping from event to event (both stations)\n"
 			"    -d, --debug=<0-7>: debug mask (bit0:event, bit1:frame, bit2:warning)\n"
 			"    -p, --port=<port#> : TCP port number (default: %u)\n"
 			"    -b, --ber=<ber> : Bit Error Rate (received data only)\n"
 			"    -l, --log=<filename> : using assigned file as log file\n"
 			"    -t, --ttl=<seconds> : set time-to-live\n"
+			"    --burst=<bytes> : bytes the idle sender may bank for a burst (default: %d)\n"
+			"    --precise[=<us>] : like --wait, but busy-poll the last <us> before a deadline (default: %d)\n"
+			"    --cpu=<n> : pin the station to CPU <n>\n"
+			"    --record=<file> : record every event, received frame and packet to <file>\n"
+			"    --replay=<file> : feed a recorded run back to the protocol, no sockets, no sleeping\n"
+			"    --launch[=<runs>] : start both stations over a socketpair, <runs> times back to back;\n"
+			"        -l and --record get -A and -B appended per station, --cpu=<n> gives B the next CPU\n"
+			"    --pool[=<n>] : preallocate <n> receive blocks and frames, report pool usage at exit\n"
+			"    --transport=<tcp|shm|uring> : link the stations by TCP (default), shared-memory rings\n"
+			"        or TCP driven by io_uring\n"
+			"    --codec=<nibble|cobs|hdlc> : framing on the wire (default: nibble)\n"
+			"    --bps=<a>[:<b>] : channel bit rate, A to B and B to A (default: %d)\n"
+			"    --delay=<ms>[:<ms>] : propagation delay, A to B and B to A (default: %d)\n"
+			"    --schedule=<file> : later bit rate and delay changes, lines of\n"
+			"        '<seconds> [bps=<a>[:<b>]] [delay=<ms>[:<ms>]]'\n"
+			"    --stress : flood traffic as fast as the link takes it, no pacing, no delay,\n"
+			"        no sleeping; report packets/s, CPU time and system calls per packet\n"
+			"    --threads : move, pace, decode and check the frames on a separate I/O thread\n"
+			"    --aqm[=<drop|mark>[,<target>[,<interval>]]] : CoDel on the sending queue, drop\n"
+			"        (or only count) frames queued longer than <target> ms for <interval> ms\n"
+			"        (default: drop,%d,%d)\n"
+			"    --ctrl-lane[=<bytes>] : frames of at most <bytes> (ACK, NAK) are sent ahead of the\n"
+			"        queued data frames, at the next frame boundary (default: %d)\n"
+			"    --bond=<n>[,<skew>] : bond <n> channels (up to %d) into one link, each with the\n"
+			"        bit rate, pacing and noise of its own and <skew> ms more delay than the last\n"
+			"    --relay[=<port>] : go through the chanemu relay (default port: %u), which sets\n"
+			"        the channel; stations with the same -p make a pair\n"
 			"\n"
 			"i.e.\n"
 			"    %s -fd3 -b 1e-4 A\n"
 			"    %s --flood --debug=3 --ber=1e-4 A\n"
 			"\n",
-			DEFAULT_PORT, argv[0], argv[0]);
+			DEFAULT_PORT, DEFAULT_BURST, DEFAULT_SPIN, CHAN_BPS, CHAN_DELAY, 
+			DEFAULT_AQM_TARGET, DEFAULT_AQM_INTERVAL, DEFAULT_LANE, MAX_BOND, DEFAULT_RELAY_PORT, 
+			argv[0], argv[0]);
 		exit(0);
 	}
 
@@ -169,6 +535,7 @@ static void config(int argc, char **argv)
 	SetConsoleTitle(fname);
 #endif
 	strcpy(fname, "");
+	strcpy(rname, "");
 
 	while ((opt = getopt_long(argc, argv, OPT_SHORT, intopts, NULL)) != -1) {
 		switch (opt) {
@@ -191,6 +558,14 @@ static void config(int argc, char **argv)
 			strcpy(fname, "nul");
 			break;
 
+		case 'w':
+			mode_wait = 1;
+			break;
+
+		case 's':
+			mode_sim = 1;
+			break;
+
 		case 'd':
 			debug_mask = atoi(optarg);
 			break;
@@ -212,7 +587,146 @@ static void config(int argc, char **argv)
 			break;
 
 		case 't':
-			mode_life = atoi(optarg) * 1000; /* ms */
+			mode_life = atoi(optarg) * 1000000LL; /* us */
+			break;
+
+		case OPT_BURST:
+			mode_burst = atoi(optarg);
+			if (mode_burst < 1) {
+				printf("Bad burst size %s\n", optarg);
+				goto usage;
+			}
+			break;
+
+		case OPT_PRECISE:
+			mode_wait = 1;
+			mode_spin = optarg ? atoi(optarg) : DEFAULT_SPIN;
+			if (mode_spin < 0) {
+				printf("Bad spin time %s\n", optarg);
+				goto usage;
+			}
+			break;
+
+		case OPT_CPU:
+			mode_cpu = atoi(optarg);
+			break;
+
+		case OPT_RECORD:
+			strcpy(rname, optarg);
+			break;
+
+		case OPT_LAUNCH:
+			mode_launch = optarg ? atoi(optarg) : 1;
+			if (mode_launch < 1) {
+				printf("Bad number of runs %s\n", optarg);
+				goto usage;
+			}
+			break;
+
+		case OPT_FD:
+			mode_fd = atoi(optarg);
+			break;
+
+		case OPT_TRANSPORT:
+			if (stricmp(optarg, "shm") == 0)
+				mode_shm = 1;
+			else if (stricmp(optarg, "uring") == 0)
+				mode_uring = 1;
+			else if (stricmp(optarg, "tcp") == 0)
+				mode_shm = mode_uring = 0;
+			else {
+				printf("Bad transport %s\n", optarg);
+				goto usage;
+			}
+			break;
+
+		case OPT_CODEC:
+			if ((mode_codec = codec_id(optarg)) == 0) {
+				printf("Bad codec %s\n", optarg);
+				goto usage;
+			}
+			break;
+
+		case OPT_BPS:
+			if (!chan_pair(optarg, chan[0].bps, 1)) {
+				printf("Bad bit rate %s\n", optarg);
+				goto usage;
+			}
+			break;
+
+		case OPT_DELAY:
+			if (!chan_pair(optarg, chan[0].delay, 1)) {
+				printf("Bad delay %s\n", optarg);
+				goto usage;
+			}
+			break;
+
+		case OPT_SCHEDULE:
+			schedule = optarg;
+			break;
+
+		case OPT_STRESS:
+			mode_stress = mode_flood = mode_wait = 1;
+			break;
+
+		case OPT_THREADS:
+			mode_threads = 1;
+			break;
+
+		case OPT_AQM:
+			mode_aqm = AQM_DROP;
+			if (optarg == NULL)
+				break;
+			if (strnicmp(optarg, "mark", 4) == 0)
+				mode_aqm = AQM_MARK;
+			else if (strnicmp(optarg, "drop", 4) != 0) {
+				printf("Bad AQM mode %s\n", optarg);
+				goto usage;
+			}
+			if (optarg[4] && (sscanf(optarg + 4, ",%d,%d", &aqm_target, &aqm_interval) < 1 ||
+				aqm_target <= 0 || aqm_interval <= 0)) {
+				printf("Bad AQM target/interval %s\n", optarg);
+				goto usage;
+			}
+			break;
+
+		case OPT_LANE:
+			mode_lane = optarg ? atoi(optarg) : DEFAULT_LANE;
+			if (mode_lane < 1) {
+				printf("Bad control frame size %s\n", optarg);
+				goto usage;
+			}
+			break;
+
+		case OPT_BOND:
+			if (sscanf(optarg, "%d,%d", &mode_bond, &bond_skew) < 1 || 
+				mode_bond < 1 || mode_bond > MAX_BOND || bond_skew < 0) {
+				printf("Bad bonding %s\n", optarg);
+				goto usage;
+			}
+			break;
+
+		case OPT_RELAY:
+			mode_relay = optarg ? atoi(optarg) : DEFAULT_RELAY_PORT;
+			if (mode_relay < 1 || mode_relay > 65535) {
+				printf("Bad relay port %s\n", optarg);
+				goto usage;
+			}
+			break;
+
+		case OPT_POOL:
+			mode_pool = optarg ? atoi(optarg) : 0;
+			if (mode_pool < 0) {
+				printf("Bad pool size %s\n", optarg);
+				goto usage;
+			}
+			break;
+
+		case OPT_REPLAY:
+			if ((replay_file = fopen(optarg, "rb")) == NULL) {
+				printf("Failed to open replay file \"%s\": %s\n", optarg, strerror(errno));
+				goto usage;
+			}
 			break;
 
 		default:
@@ -221,12 +735,30 @@ static void config(int argc, char **argv)
 		}
 	}
 
+	if (mode_launch)
+		launch(argc, argv);
+
 	if (optind == argc) 
 		goto usage;
 
 	station = tolower(argv[optind++][0]);
 	if (station != 'a' && station != 'b')
 		ABORT("Station name must be 'A' or 'B'");
+	chan_setup(schedule);
+
+	if (mode_fd >= 0) {
+		/* started by --launch: the two stations must not share a file or a CPU */
+		if (fname[0] && stricmp(fname, "nul") != 0)
+			strcat(fname, station == 'a' ? "-A" : "-B");
+		if (rname[0])
+			strcat(rname, station == 'a' ? "-A" : "-B");
+		if (mode_cpu >= 0 && station == 'b')
+			mode_cpu += mode_threads ? 2 : 1; /* the I/O thread takes the CPU after its station's */
+	}
+	if (rname[0] && (record_file = fopen(rname, "wb")) == NULL) {
+		printf("Failed to create record file \"%s\": %s\n", rname, strerror(errno));
+		exit(1);
+	}
 
 	if (fname[0] == 0) {
 		strcpy(fname, argv[0]);
@@ -247,575 +779,3938 @@ static void config(int argc, char **argv)
 		station_name());
 
 	lprintf("Protocol.lib, version %s, jiangyanjun0718@bupt.edu.cn\n", VERSION, __DATE__);
-	lprintf("Channel: %d bps, %d ms propagation delay, bit error rate ", CHAN_BPS, CHAN_DELAY);
+	if (chan[0].bps[0] == chan[0].bps[1] && chan[0].delay[0] == chan[0].delay[1])
+		lprintf("Channel: %d bps, %d ms propagation delay, bit error rate ", chan[0].bps[0], chan[0].delay[0]);
+	else
+		lprintf("Channel: A->B %d bps %d ms, B->A %d bps %d ms, bit error rate ", 
+			chan[0].bps[0], chan[0].delay[0], chan[0].bps[1], chan[0].delay[1]);
 	if (ber > 0.0)
 		lprintf("%.1E\n", ber);
 	else
 		lprintf("0\n");
+	for (i = 1; i < chan_nstep; i++)
+		lprintf("Channel at %.3f s: A->B %d bps %d ms, B->A %d bps %d ms\n", chan[i].ts / 1000000.0,
+			chan[i].bps[0], chan[i].delay[0], chan[i].bps[1], chan[i].delay[1]);
 	lprintf("Log file \"%s\", TCP port %d, debug mask 0x%02x\n", fname, port, debug_mask);
+	if (mode_sim)
+		lprintf("Virtual-time simulation\n");
+	if (mode_stress && mode_sim)
+		ABORT("--stress measures real time, it does not run with --sim");
+	if (mode_stress)
+		lprintf("CPU stress: unpaced channel, no propagation delay\n");
+	if (mode_shm)
+		lprintf("Shared-memory transport\n");
+	if (mode_uring && mode_sim) {
+		lprintf("WARNING: --sim exchanges blocking records, io_uring is not used\n");
+		mode_uring = 0;
+	}
+	if (mode_uring)
+		lprintf("io_uring transport\n");
+	if (mode_threads) {
+#ifndef __linux__
+		ABORT("--threads is only supported on Linux");
+#endif
+		if (mode_sim || mode_shm || mode_uring)
+			ABORT("--threads runs a TCP link, not --sim, shm or io_uring");
+		lprintf("Physical layer on its own I/O thread\n");
+	}
+	if (mode_aqm)
+		lprintf("AQM: CoDel %s, target %d ms, interval %d ms\n", 
+			mode_aqm == AQM_MARK ? "marking" : "dropping", aqm_target, aqm_interval);
+	if (mode_lane)
+		lprintf("Control lane for frames up to %d bytes\n", mode_lane);
+	if (mode_bond > 1) {
+		if (mode_threads || mode_uring)
+			ABORT("--bond does not run with --threads or io_uring");
+		lprintf("Bonded link: %d channels, delay skew %d ms\n", mode_bond, bond_skew);
+	}
+	if (mode_relay) {
+		if (mode_sim || mode_shm || mode_threads || mode_stress || mode_bond > 1 || mode_fd >= 0 || replay_file)
+			ABORT("--relay runs a TCP link, not --sim, shm, --threads, --stress, --bond, --launch or --replay");
+		if (chan_nstep > 1)
+			ABORT("--relay takes the channel from the relay, not from --schedule");
+		lprintf("Channel emulated by the relay on TCP port %d\n", mode_relay);
+	}
+	if (record_file && replay_file)
+		ABORT("--record and --replay are exclusive");
 }
 
-/* Create Communication Sockets  */
+/* 
+   Shared-memory transport (--transport=shm)
+
+   Station A and B map one segment holding a lock-free single-producer
+   single-consumer byte ring per direction, so the wire bytes never go
+   through the kernel. Each station has a doorbell, a futex word the peer
+   bumps after putting data into its receiving ring or taking data out of
+   its sending ring; a station only sleeps on its own doorbell, and the
+   peer makes the futex_wake() call only while it is sleeping.
+   The segment is named after the TCP port, or inherited from --launch.
+*/
+
+#ifdef __linux__
+
+#define SHM_RING_SIZE (64 * 1024) /* like the socket buffers, power of 2 */
+
+struct SHM_RING {
+    volatile unsigned int tail;   /* written by the producer only */
+    char pad0[60];
+    volatile unsigned int head;   /* written by the consumer only */
+    char pad1[60];
+    volatile int closed;          /* producer has quit */
+    char pad2[60];
+    unsigned char data[SHM_RING_SIZE];
+};
 
-void protocol_init(int argc, char **argv)
-{
-    int admin_sock, i;
-    struct sockaddr_in name;
+struct SHM_LINK {
+    volatile int state;           /* 1: created by A, 2: epoch set by B */
+    long long epoch;
+    volatile int bell[2];         /* doorbell of station A/B */
+    volatile int sleeping[2];
+    struct SHM_RING ring[2];      /* ring[0]: A to B, ring[1]: B to A */
+};
 
-	socket_init();
-	magic_init();
+static struct SHM_LINK *shm;
+static struct SHM_RING *shm_tx, *shm_rx;
+static int shm_me;
 
-	config(argc, argv);
-  
-    if (station == 'a') {
+static void shm_ring_bell(void)
+{
+    int peer = 1 - shm_me;
 
-        srand(mode_seed ^ 97209);
+    __sync_fetch_and_add(&shm->bell[peer], 1);
+    __sync_synchronize();
+    if (shm->sleeping[peer])
+        SYSCALL(syscall(SYS_futex, &shm->bell[peer], FUTEX_WAKE, 1, NULL, NULL, 0));
+}
 
-        name.sin_family = AF_INET;
-        name.sin_addr.s_addr = INADDR_ANY;
-        name.sin_port = htons(port);
+static int shm_readable(void)
+{
+    return shm_rx->tail != shm_rx->head || shm_rx->closed;
+}
 
-        admin_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (admin_sock < 0) 
-            ABORT("Create TCP socket");
-        if (bind(admin_sock, (struct sockaddr *)&name, sizeof(name)) < 0) {
-            lprintf("Station A: Failed to bind TCP port %u", port);
-            ABORT("Station A failed to bind TCP port");
-        }
+static int shm_writable(void)
+{
+    return shm_tx->tail - shm_tx->head < SHM_RING_SIZE;
+}
 
-        listen(admin_sock, 5);
+/* 
+   sleep on the doorbell until the receiving ring has data (or space in
+   the sending ring if 'writing') or 'us' microseconds pass, -1 for ever.
+   Returns 0 on timeout.
+*/
+static int shm_wait(int writing, long long us)
+{
+    struct timespec ts;
+    int seq, ret = 1;
+
+    seq = shm->bell[shm_me];
+    shm->sleeping[shm_me] = 1;
+    __sync_synchronize();
+
+    if (!shm_readable() && !(writing && shm_writable())) {
+        ts.tv_sec = (time_t)(us / 1000000);
+        ts.tv_nsec = (long)(us % 1000000 * 1000);
+        if (SYSCALL(syscall(SYS_futex, &shm->bell[shm_me], FUTEX_WAIT, seq, us < 0 ? NULL : &ts, NULL, 0)) < 0 
+            && errno == ETIMEDOUT)
+            ret = 0;
+    }
 
-        lprintf("Station A is waiting for station B on TCP port %u ... ", port);
-        fflush(stdout);
+    shm->sleeping[shm_me] = 0;
+    return ret;
+}
 
-        sock = accept(admin_sock, 0, 0);
-        if (sock < 0) 
-            ABORT("Station A failed to communicate with station B");
-        lprintf("Done.\n");
+/* copy what fits of 'cnt' buffers into the sending ring, returns bytes taken */
+static int shm_sendv(unsigned char **buf, int *len, int cnt)
+{
+    unsigned int tail = shm_tx->tail, room, n, k;
+    int i, total = 0;
 
-        recv(sock, (char *)&epoch, sizeof(epoch), 0);
+    if (shm_rx->closed) /* the peer is gone, like EPIPE */
+        return 0;
+
+    room = SHM_RING_SIZE - (tail - shm_tx->head);
+    for (i = 0; i < cnt && room > 0; i++) {
+        n = (unsigned int)len[i] < room ? (unsigned int)len[i] : room;
+        k = SHM_RING_SIZE - (tail & (SHM_RING_SIZE - 1));
+        if (k > n)
+            k = n;
+        memcpy(shm_tx->data + (tail & (SHM_RING_SIZE - 1)), buf[i], k);
+        memcpy(shm_tx->data, buf[i] + k, n - k);
+        tail += n;
+        room -= n;
+        total += n;
     }
+    if (total == 0)
+        return -1;
 
-    if (station == 'b') {
+    __sync_synchronize();
+    shm_tx->tail = tail;
+    shm_ring_bell();
 
-        srand(mode_seed ^ 18231);
+    return total;
+}
 
-        sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (sock < 0) 
-            ABORT("Create TCP socket");
+/* like recv(): bytes read, 0 if the peer has quit, -1 if the ring is empty */
+static int shm_recv(unsigned char *buf, int size)
+{
+    unsigned int head = shm_rx->head, n, k;
+
+    n = shm_rx->tail - head;
+    if (n == 0)
+        return shm_rx->closed ? 0 : -1;
+
+    __sync_synchronize();
+    if (n > (unsigned int)size)
+        n = size;
+    k = SHM_RING_SIZE - (head & (SHM_RING_SIZE - 1));
+    if (k > n)
+        k = n;
+    memcpy(buf, shm_rx->data + (head & (SHM_RING_SIZE - 1)), k);
+    memcpy(buf + k, shm_rx->data, n - k);
+
+    __sync_synchronize();
+    shm_rx->head = head + n;
+    shm_ring_bell();
+
+    return (int)n;
+}
 
-        name.sin_family = AF_INET;
-        name.sin_addr.s_addr = inet_addr("127.0.0.1");
-        name.sin_port = htons((short)port);
+/* tell the peer no more data will come */
+static void shm_close(void)
+{
+    if (shm && !shm_tx->closed) {
+        __sync_synchronize();
+        shm_tx->closed = 1;
+        shm_ring_bell();
+    }
+}
 
+/* a zero-filled, unnamed segment for --launch */
+static int shm_create_anon(void)
+{
+    char name[64];
+    int fd;
+
+    sprintf(name, "/datalink-launch-%d", (int)getpid());
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        printf("shm_open(): %s\n", strerror(errno));
+        exit(1);
+    }
+    shm_unlink(name);
+    fcntl(fd, F_SETFD, 0); /* shm_open() sets FD_CLOEXEC, the stations need it */
+    if (ftruncate(fd, sizeof(struct SHM_LINK)) < 0) {
+        printf("ftruncate(): %s\n", strerror(errno));
+        exit(1);
+    }
+    return fd;
+}
+
+static void shm_connect(void)
+{
+    char name[64];
+    int fd, i;
+
+    sprintf(name, "/datalink-%u", port);
+
+    if (mode_fd >= 0)
+        fd = mode_fd;
+    else if (station == 'a') {
+        fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+        /* clear whatever an earlier run left behind */
+        if (fd < 0 || ftruncate(fd, 0) < 0 || ftruncate(fd, sizeof(struct SHM_LINK)) < 0)
+            ABORT("Station A failed to create the shared memory segment");
+    } else {
         for (i = 0; i < 60; i++) {
-            lprintf("Station B is connecting station A (TCP port %u) ... ", port);
+            lprintf("Station B is connecting station A (shared memory %s) ... ", name);
             fflush(stdout);
-
-            if (connect(sock, (struct sockaddr *)&name, sizeof(struct sockaddr_in)) < 0) {
-                lprintf("Failed!\n");
-                Sleep(2000);
-            } else {
+            if ((fd = shm_open(name, O_RDWR, 0)) >= 0) {
                 lprintf("Done.\n");
                 break;
             }
+            lprintf("Failed!\n");
+            Sleep(2000);
         }
-        if (i == 6)
+        if (i == 60)
             ABORT("Station B failed to connect station A");
-
-        time(&epoch);
-        send(sock, (char *)&epoch, sizeof(epoch), 0);
     }
 
-    {
-        struct tm *newtime;
-        newtime = localtime(&epoch);
-        lprintf("New epoch: %s", asctime(newtime));
-        lprintf("=================================================================\n\n");
+    shm = (struct SHM_LINK *)mmap(NULL, sizeof(struct SHM_LINK), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shm == MAP_FAILED)
+        ABORT("Failed to map the shared memory segment");
+    close(fd);
+
+    shm_me = station == 'a' ? 0 : 1;
+    shm_tx = &shm->ring[shm_me];
+    shm_rx = &shm->ring[1 - shm_me];
+
+    if (station == 'a') {
+        if (mode_fd < 0) {
+            __sync_synchronize();
+            shm->state = 1;
+            lprintf("Station A is waiting for station B on shared memory %s ... ", name);
+            fflush(stdout);
+        }
+        while (shm->state != 2)
+            Sleep(1);
+        if (mode_fd < 0)
+            lprintf("Done.\n");
+        epoch = shm->epoch;
+    } else {
+        while (mode_fd < 0 && shm->state != 1) /* A is still setting it up */
+            Sleep(1);
+        if (mode_fd < 0)
+            shm_unlink(name);
+        epoch = monotonic_us();
+        shm->epoch = epoch;
+        __sync_synchronize();
+        shm->state = 2;
     }
+}
 
-    /* socket options */
-    {
-        int timeout_ms = 10; 
-        int buf_size = 1024 * 64;
-        int on = 1;
+#else
 
-        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout_ms, sizeof(int));
-        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout_ms, sizeof(int));
+#define shm_readable()         0
+#define shm_wait(writing, us)  0
+#define shm_sendv(buf, len, n) 0
+#define shm_recv(buf, size)    0
+#define shm_close()
+#define shm_create_anon()      (-1)
 
-        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char *)&buf_size, sizeof(int));
+static void shm_connect(void)
+{
+    ABORT("--transport=shm is only supported on Linux");
+}
+
+#endif
+
+#ifdef _WIN32
+
+static void launch(int argc, char **argv)
+{
+	ABORT("--launch is not supported on Windows, start A and B by hand");
+}
+
+#else
+
+/* 
+   Start station A and B as children linked by a socketpair() or, with
+   --transport=shm, one shared memory segment, so there is
+   no port to pick and no connect() to retry. The children get the options
+   of this command line (getopt has moved them in front of optind) with
+   --launch replaced by --fd=<n>; config() then gives each of them its own
+   log and record file and CPU.
+*/
+static pid_t launch_station(char **argv, int n, int fd, int other, char *name)
+{
+	char fdarg[32];
+	pid_t pid;
+
+	sprintf(fdarg, "--fd=%d", fd);
+	argv[n] = fdarg;
+	argv[n + 1] = name;
+	argv[n + 2] = NULL;
+
+	if ((pid = fork()) < 0) {
+		printf("Failed to fork station %s: %s\n", name, strerror(errno));
+		exit(1);
+	}
+	if (pid == 0) {
+		if (other >= 0)
+			close(other);
+		execvp(argv[0], argv);
+		printf("Failed to start %s: %s\n", argv[0], strerror(errno));
+		_exit(127);
+	}
+	return pid;
+}
+
+static void launch(int argc, char **argv)
+{
+	char **args;
+	int i, n, run, sv[2], status[2], failed = 0;
+	pid_t pid[2];
+	long long t0, t;
+
+	if (optind < argc)
+		ABORT("--launch starts both stations, leave out the station name");
+
+	args = (char **)malloc((optind + 3) * sizeof(char *));
+	if (args == NULL)
+		ABORT("No memory");
+	for (i = n = 0; i < optind; i++) {
+		if (strncmp(argv[i], "--launch", 8) != 0)
+			args[n++] = argv[i];
+	}
+
+	t0 = monotonic_us();
+	for (run = 1; run <= mode_launch; run++) {
+		t = monotonic_us();
+		if (mode_shm) {
+			/* both stations map the same segment */
+			sv[0] = shm_create_anon();
+			fflush(stdout);
+			pid[0] = launch_station(args, n, sv[0], -1, "A");
+			pid[1] = launch_station(args, n, sv[0], -1, "B");
+			close(sv[0]);
+		} else {
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+				printf("socketpair(): %s\n", strerror(errno));
+				exit(1);
+			}
+			fflush(stdout);
+			pid[0] = launch_station(args, n, sv[0], sv[1], "A");
+			pid[1] = launch_station(args, n, sv[1], sv[0], "B");
+			close(sv[0]);
+			close(sv[1]);
+		}
+
+		waitpid(pid[0], &status[0], 0);
+		waitpid(pid[1], &status[1], 0);
+		for (i = 0; i < 2; i++) {
+			/* the station that outlives its peer gets SIGPIPE, as with TCP */
+			if (WIFSIGNALED(status[i]) && WTERMSIG(status[i]) == SIGPIPE)
+				continue;
+			if (!WIFEXITED(status[i]) || WEXITSTATUS(status[i]) != 0) {
+				printf("Station %c failed\n", 'A' + i);
+				failed++;
+			}
+		}
+		if (mode_launch > 1)
+			printf("Run %d of %d: %.3f s\n", run, mode_launch, (monotonic_us() - t) / 1e6);
+	}
+	if (mode_launch > 1)
+		printf("%d runs in %.3f s, %d station(s) failed\n", mode_launch, (monotonic_us() - t0) / 1e6, failed);
+
+	free(args);
+	exit(failed ? 1 : 0);
+}
+
+#endif
+
+static void lateness_dump(void);
+static void stress_dump(void);
+static void aqm_dump(void);
+static void lane_dump(void);
+static void cancel_dump(void);
+static void bond_dump(void);
+static void io_start(void);
+static void io_stop(void);
+static void io_send(void *f);
+static void io_deliver(void *f);
+static void io_release(void *f);
+static int  io_wait(long long deadline);
+static void pool_init(void);
+struct BLK;
+static void bond_negotiate(void);
+static void bond_pick(void);
+static void bond_use(int m);
+static int  bond_write(unsigned char **buf, int *len, int cnt);
+static void bond_demux(struct BLK *blk, long long ts);
+static long long bond_pace_deadline(void);
+static long long rblk_deadline(void);
+static int  sq_total(void);
+static void ur_init(void);
+static void codec_negotiate(void);
+static void chan_negotiate(void);
+static void relay_negotiate(void);
+static void pool_dump(void);
+static void record_open(void);
+static void record_close(void);
+static void replay_open(void);
+static void record_events(struct event *evs, int n);
+static void record_data(int tag, unsigned char *buf, int len);
+static int  replay_events(struct event *evs, int max);
+static int  replay_data(int tag, unsigned char *buf, int size);
+
+/* statistics reported when the station quits */
+static void protocol_exit(void)
+{
+    io_stop();
+    stress_dump();
+    aqm_dump();
+    lane_dump();
+    cancel_dump();
+    bond_dump();
+    lateness_dump();
+    pool_dump();
+    record_close();
+    shm_close();
+}
+
+#ifdef _WIN32
+
+static void pin_cpu(int cpu)
+{
+    if (SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) == 0)
+        lprintf("WARNING: Failed to pin to CPU %d\n", cpu);
+    else
+        lprintf("Pinned to CPU %d\n", cpu);
+}
+
+#elif defined(__linux__)
+
+static void pin_cpu(int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+        lprintf("WARNING: Failed to pin to CPU %d: %s\n", cpu, strerror(errno));
+    else
+        lprintf("Pinned to CPU %d\n", cpu);
+}
+
+#else
+
+static void pin_cpu(int cpu)
+{
+    lprintf("WARNING: CPU pinning is not supported on this platform\n");
+}
+
+#endif
+
+/* Create Communication Sockets  */
+
+void protocol_init(int argc, char **argv)
+{
+    int admin_sock, i;
+    struct sockaddr_in name;
+
+	socket_init();
+	magic_init();
+
+	config(argc, argv);
+
+	if (mode_cpu >= 0)
+		pin_cpu(mode_cpu);
+	atexit(protocol_exit);
+	pool_init();
+
+	if (record_file)
+		record_open();
+	if (replay_file) {
+		replay_open();
+		return;
+	}
+  
+    if (mode_shm) {
+
+        srand(mode_seed ^ (station == 'a' ? 97209 : 18231));
+        shm_connect();
+
+    } else if (mode_fd >= 0) {
+
+        /* link handed over by --launch, already connected */
+        sock = mode_fd;
+        srand(mode_seed ^ (station == 'a' ? 97209 : 18231));
+        if (station == 'a') {
+            recv(sock, (char *)&epoch, sizeof(epoch), 0);
+        } else {
+            epoch = monotonic_us();
+            send(sock, (char *)&epoch, sizeof(epoch), 0);
+        }
+
+    } else if (mode_relay) {
+
+        /* both stations connect to chanemu, relay_negotiate() pairs them up */
+        srand(mode_seed ^ (station == 'a' ? 97209 : 18231));
+
+        sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (sock < 0) 
+            ABORT("Create TCP socket");
+
+        name.sin_family = AF_INET;
+        name.sin_addr.s_addr = inet_addr("127.0.0.1");
+        name.sin_port = htons((short)mode_relay);
+
+        for (i = 0; i < 60; i++) {
+            lprintf("Station %s is connecting the relay (TCP port %u) ... ", station_name(), mode_relay);
+            fflush(stdout);
+
+            if (connect(sock, (struct sockaddr *)&name, sizeof(struct sockaddr_in)) < 0) {
+                lprintf("Failed!\n");
+                Sleep(2000);
+            } else {
+                lprintf("Done.\n");
+                break;
+            }
+        }
+        if (i == 60)
+            ABORT("Failed to connect the relay");
+
+    } else if (station == 'a') {
+
+        srand(mode_seed ^ 97209);
+
+        name.sin_family = AF_INET;
+        name.sin_addr.s_addr = INADDR_ANY;
+        name.sin_port = htons(port);
+
+        admin_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (admin_sock < 0) 
+            ABORT("Create TCP socket");
+        if (bind(admin_sock, (struct sockaddr *)&name, sizeof(name)) < 0) {
+            lprintf("Station A: Failed to bind TCP port %u", port);
+            ABORT("Station A failed to bind TCP port");
+        }
+
+        listen(admin_sock, 5);
+
+        lprintf("Station A is waiting for station B on TCP port %u ... ", port);
+        fflush(stdout);
+
+        sock = accept(admin_sock, 0, 0);
+        if (sock < 0) 
+            ABORT("Station A failed to communicate with station B");
+        lprintf("Done.\n");
+
+        recv(sock, (char *)&epoch, sizeof(epoch), 0);
+
+    } else {
+
+        srand(mode_seed ^ 18231);
+
+        sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (sock < 0) 
+            ABORT("Create TCP socket");
+
+        name.sin_family = AF_INET;
+        name.sin_addr.s_addr = inet_addr("127.0.0.1");
+        name.sin_port = htons((short)port);
+
+        for (i = 0; i < 60; i++) {
+            lprintf("Station B is connecting station A (TCP port %u) ... ", port);
+            fflush(stdout);
+
+            if (connect(sock, (struct sockaddr *)&name, sizeof(struct sockaddr_in)) < 0) {
+                lprintf("Failed!\n");
+                Sleep(2000);
+            } else {
+                lprintf("Done.\n");
+                break;
+            }
+        }
+        if (i == 60)
+            ABORT("Station B failed to connect station A");
+
+        epoch = monotonic_us();
+        send(sock, (char *)&epoch, sizeof(epoch), 0);
+    }
+
+    {
+        struct tm *newtime;
+        time_t wall = time(0);
+        newtime = localtime(&wall);
+        lprintf("New epoch: %s", asctime(newtime));
+        lprintf("=================================================================\n\n");
+    }
+
+    /* socket options */
+    if (!mode_shm) {
+        int timeout_ms = 10; 
+        int buf_size = 1024 * 64;
+        int on = 1;
+
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout_ms, sizeof(int));
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout_ms, sizeof(int));
+
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char *)&buf_size, sizeof(int));
         setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (char *)&buf_size, sizeof(int));
 
-        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on));   
-    }   
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on));   
+    }   
+
+    if (mode_relay)
+        relay_negotiate();
+    else {
+        codec_negotiate();
+        chan_negotiate();
+        bond_negotiate();
+    }
+
+    if (mode_uring)
+        ur_init();
+    if (mode_threads)
+        io_start();
+
+    get_ms();
+}
+
+static int  sim_sendv(unsigned char **buf, int *len, int cnt);
+static int  ur_send(unsigned char **buf, int *len, int cnt);
+static void sim_recv(void);
+static void sim_advance(long long deadline);
+
+/* Physical Layer: Sender */
+
+/* 
+   Sending queue: a list of encoded frames, each sent in pieces as the
+   pacing allows. It grows as needed, the protocol is expected to keep it
+   short by waiting for PHYSICAL_LAYER_READY.
+*/
+
+struct SQ_FRAME {
+    int len, sent;
+    unsigned int id; /* handle given to the protocol */
+    int with_crc;
+    int ctrl;      /* --ctrl-lane: a control frame */
+    int judged;    /* --aqm: the dequeue decision is made */
+    long long ts;  /* queued at */
+    struct SQ_FRAME *next;
+    unsigned char data[1]; /* 'len' wire bytes */
+};
+
+static struct SQ_FRAME *sq_head, *sq_tail;
+static int sq_bytes; /* wire bytes queued and not sent yet */
+static int sq_inflight; /* io_uring: bytes submitted and not completed yet */
+static int sq_inflight_frames; /* ... from this many frames at the head */
+static int inform_phl_ready = 1;
+
+#define SQ_IOV 64 /* frames handed to the socket in one call */
+
+/* sq_bytes is counted up and down by different threads under --threads */
+#ifdef _MSC_VER
+#define sq_add(n) (sq_bytes += (n))
+#else
+#define sq_add(n) __atomic_add_fetch(&sq_bytes, (n), __ATOMIC_RELAXED)
+#endif
+
+/* 
+   Token bucket pacing the sending queue at exactly the outgoing bit rate. 
+   Credit is kept in bit-microseconds (a wire byte costs the bits it carries
+   under the framing codec, 4 for a nibble), which makes the refill exact and carries fractional
+   bytes over from call to call. While the queue is idle the credit is capped
+   at 'mode_burst' bytes; with a backlog nothing earned is ever thrown away.
+*/
+
+#define TB_BYTE (wire_bits * 1000000LL)
+
+static long long tb_credit, tb_ts;
+
+static void tb_refill(int idle)
+{
+    if (tb_ts == 0)
+        tb_ts = now;
+
+    tb_credit += chan_bits(chan_out(), tb_ts, now);
+    tb_ts = now;
+
+    if (idle && tb_credit > mode_burst * TB_BYTE)
+        tb_credit = mode_burst * TB_BYTE;
+}
+
+static int sq_len(void)
+{
+    return sq_bytes;
+}
+
+/* 
+   Control lane (--ctrl-lane): a control frame goes behind the control
+   frames already waiting, ahead of every data frame that has not started
+   going out. The frame on the wire (or in an io_uring batch) is finished
+   first, so the byte stream only changes order at frame boundaries.
+*/
+
+/* the frame a control frame is queued after, NULL for the head */
+static struct SQ_FRAME *sq_lane_pos(void)
+{
+    struct SQ_FRAME *f, *prev = NULL;
+    int busy = sq_inflight ? sq_inflight_frames : 0;
+
+    for (f = sq_head; f && (f->sent > 0 || f->ctrl || busy > 0); f = f->next, busy--)
+        prev = f;
+    return prev;
+}
+
+/* queueing delay of the frames sent, data [0] and control [1] */
+static long long lane_frames[2], lane_delay[2], lane_max[2];
+
+static void lane_account(struct SQ_FRAME *f)
+{
+    long long d = now - f->ts;
+
+    lane_frames[f->ctrl]++;
+    lane_delay[f->ctrl] += d;
+    if (d > lane_max[f->ctrl])
+        lane_max[f->ctrl] = d;
+}
+
+static void lane_dump(void)
+{
+    if (!mode_lane || lane_frames[1] == 0)
+        return;
+
+    lprintf("Control lane: %lld control frames queued avg %.3f s max %.3f s, "
+        "%lld data frames avg %.3f s max %.3f s\n", 
+        lane_frames[1], lane_delay[1] / 1000000.0 / lane_frames[1], lane_max[1] / 1000000.0,
+        lane_frames[0], lane_frames[0] ? lane_delay[0] / 1000000.0 / lane_frames[0] : 0.0, 
+        lane_max[0] / 1000000.0);
+}
+
+/* queue an encoded frame for socket_send() */
+static void sq_append(struct SQ_FRAME *f)
+{
+    struct SQ_FRAME *pos;
+
+    /* the link was idle up to now, bank at most a burst of credit */
+    if (sq_head == NULL)
+        tb_refill(1);
+
+    f->next = NULL;
+    if (f->ctrl && (pos = sq_lane_pos()) != sq_tail) {
+        if (pos == NULL) {
+            f->next = sq_head;
+            sq_head = f;
+        } else {
+            f->next = pos->next;
+            pos->next = f;
+        }
+        return;
+    }
+
+    if (sq_head == NULL)
+        sq_head = f;
+    else
+        sq_tail->next = f;
+    sq_tail = f;
+}
+
+int phl_sq_len(void)
+{
+    return sq_total();
+}
+
+static int codec_max_wire(int len);
+static int codec_encode(unsigned char *out, const unsigned char *frame, int len, unsigned int *crc);
+
+static unsigned int sq_id; /* last handle given out */
+
+/* encode a frame, followed by its CRC if 'with_crc' */
+static struct SQ_FRAME *sq_encode(const unsigned char *frame, int len, int with_crc)
+{
+    struct SQ_FRAME *f;
+    unsigned int crc;
+
+    f = (struct SQ_FRAME *)malloc(sizeof(struct SQ_FRAME) + codec_max_wire(len + (with_crc ? 4 : 0)));
+    if (f == NULL)
+        ABORT("Physical Layer Sending Queue: no memory");
+
+    f->len = codec_encode(f->data, frame, len, with_crc ? &crc : NULL);
+    f->sent = 0;
+    f->with_crc = with_crc;
+    f->ctrl = len <= mode_lane;
+    f->judged = 0;
+    f->ts = now;
+    return f;
+}
+
+/* queue a frame, returns its handle */
+static unsigned int sq_put(const unsigned char *frame, int len, int with_crc)
+{
+    struct SQ_FRAME *f;
+
+    if (++sq_id == 0)
+        sq_id = 1;
+    if (replay_file)
+        return sq_id;
+
+    inform_phl_ready = 1;
+
+    f = sq_encode(frame, len, with_crc);
+    f->id = sq_id;
+    if (mode_bond > 1)
+        bond_pick();
+    sq_add(f->len);
+
+    if (mode_threads)
+        io_send(f);
+    else
+        sq_append(f);
+
+    return f->id;
+}
+
+unsigned int send_frame(unsigned char *frame, int len)
+{
+    return sq_put(frame, len, 0);
+}
+
+unsigned int send_frame_crc(unsigned char *frame, int len)
+{
+    return sq_put(frame, len, 1);
+}
+
+/* 
+   Taking frames back. Until its first byte goes out, a queued frame can
+   be cancelled, or replaced by new contents at its place in the queue
+   (a retransmission still waiting, given a newer piggybacked ACK; a 
+   standalone ACK overtaken by a newer one). Under --threads the frames
+   are handed to the I/O thread at once and cannot be taken back. The
+   outcome is recorded, so a replay takes the same branches.
+*/
+
+static int sq_cancelled, sq_replaced, sq_saved; /* frames, frames, wire bytes */
+
+/* the queued frame of 'handle' if it can still be taken back */
+static struct SQ_FRAME *sq_find(unsigned int handle, struct SQ_FRAME **prev)
+{
+    struct SQ_FRAME *f, *p;
+    int m, busy = sq_inflight ? sq_inflight_frames : 0;
+
+    if (handle == 0 || mode_threads || replay_file)
+        return NULL;
+
+    /* the frame's member is left in use for sq_unlink() */
+    for (m = 0; m < mode_bond; m++) {
+        bond_use(m);
+        for (f = sq_head, p = NULL; f; p = f, f = f->next, busy--) {
+            if (f->id == handle) {
+                if (f->sent > 0 || busy > 0)
+                    return NULL;
+                *prev = p;
+                return f;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* take 'f' out of the queue, putting 'r' (if any) in its place */
+static void sq_unlink(struct SQ_FRAME *f, struct SQ_FRAME *prev, struct SQ_FRAME *r)
+{
+    struct SQ_FRAME *next = f->next;
+
+    if (r) {
+        r->next = next;
+        next = r;
+    }
+    if (prev)
+        prev->next = next;
+    else
+        sq_head = next;
+    if (sq_tail == f)
+        sq_tail = r ? r : prev;
+
+    sq_add((r ? r->len : 0) - f->len);
+    free(f);
+}
+
+static int sq_outcome(int ok)
+{
+    unsigned char r = (unsigned char)ok;
+
+    if (replay_file) {
+        replay_data('C', &r, 1);
+        return r;
+    }
+    if (record_file)
+        record_data('C', &r, 1);
+    return ok;
+}
+
+int cancel_frame(unsigned int handle)
+{
+    struct SQ_FRAME *f, *prev;
+
+    if ((f = sq_find(handle, &prev)) != NULL) {
+        sq_cancelled++;
+        sq_saved += f->len;
+        sq_unlink(f, prev, NULL);
+    }
+    return sq_outcome(f != NULL);
+}
+
+int replace_frame(unsigned int handle, unsigned char *frame, int len)
+{
+    struct SQ_FRAME *f, *prev, *r;
+
+    if ((f = sq_find(handle, &prev)) != NULL) {
+        r = sq_encode(frame, len, f->with_crc);
+        r->id = f->id;
+        r->ts = f->ts;
+        r->ctrl = f->ctrl;
+        r->judged = f->judged;
+        sq_replaced++;
+        sq_saved += r->len; /* the copy the protocol would have sent instead */
+        sq_unlink(f, prev, r);
+    }
+    return sq_outcome(f != NULL);
+}
+
+static void cancel_dump(void)
+{
+    if (sq_cancelled + sq_replaced == 0)
+        return;
+
+    lprintf("Sending queue: %d frames cancelled, %d replaced in place, %d wire bytes saved\n",
+        sq_cancelled, sq_replaced, sq_saved);
+}
+
+/* the peer is gone; the I/O thread of --threads leaves the exit to the protocol thread */
+static int link_lost(void)
+{
+    if (mode_threads) {
+        io_down = 1;
+        return 0;
+    }
+    lprintf("TCP disconnected.\n");
+    exit(0);
+}
+
+/* hand pieces of the first 'cnt' queued frames to the link, returns bytes taken */
+static int send_sq_data(unsigned char **buf, int *len, int cnt)
+{
+    int i, ret;
+
+    if (mode_sim)
+        return sim_sendv(buf, len, cnt);
+
+    if (mode_shm) {
+        if ((ret = shm_sendv(buf, len, cnt)) == 0) {
+            lprintf("TCP Disconnected.\n");
+            exit(0);
+        }
+        return ret < 0 ? 0 : ret;
+    }
+
+#ifdef _WIN32
+    for (i = ret = 0; i < cnt; i++) {
+        int r = SYSCALL(send(sock, (char *)buf[i], len[i], 0));
+        if (r <= 0 && ret == 0) {
+            lprintf("TCP Disconnected.\n");
+            exit(0);
+        }
+        if (r <= 0)
+            break;
+        ret += r;
+        if (r < len[i])
+            break;
+    }
+#else
+    {
+        struct iovec iov[SQ_IOV];
+
+        for (i = 0; i < cnt; i++) {
+            iov[i].iov_base = buf[i];
+            iov[i].iov_len = len[i];
+        }
+        ret = (int)SYSCALL(writev(sock, iov, cnt));
+        if (ret <= 0)
+            return link_lost();
+    }
+#endif
+
+    return ret;
+}
+
+/* 'send_bytes' from the head of the queue have left */
+static void sq_consume(int send_bytes)
+{
+    struct SQ_FRAME *f;
+    int n;
+
+    sq_add(-send_bytes);
+
+    while (send_bytes > 0) {
+        f = sq_head;
+        n = f->len - f->sent < send_bytes ? f->len - f->sent : send_bytes;
+        f->sent += n;
+        send_bytes -= n;
+        if (f->sent == f->len) {
+            sq_head = f->next;
+            lane_account(f);
+            free(f);
+        }
+    }
+    if (sq_head == NULL)
+        sq_tail = NULL;
+}
+
+/* 
+   Active queue management (--aqm): CoDel on the sending queue. The
+   sojourn time of every frame is taken when it starts to go out; once it
+   stayed above 'aqm_target' for a whole 'aqm_interval', frames are dropped
+   (or only marked and counted) as they start, at a rate growing with the
+   square root of the drops, until the standing queue is gone. A queue of
+   a single frame is never above target, that is the link's own pace.
+*/
+
+static long long aqm_first_above, aqm_drop_next;
+static int aqm_dropping, aqm_count, aqm_last_count;
+static long long aqm_frames, aqm_sojourn, aqm_max; /* sojourn sum and maximum (us) */
+static int aqm_drops, aqm_marks;
+
+static long long aqm_control_law(long long t)
+{
+    return t + (long long)(aqm_interval * 1000 / sqrt((double)aqm_count));
+}
+
+/* 'ahead': wire bytes still queued in front of 'f' */
+static int aqm_ok_to_drop(struct SQ_FRAME *f, int ahead)
+{
+    long long sojourn = now - f->ts;
+
+    if (sojourn < aqm_target * 1000LL || sq_len() - ahead <= f->len) {
+        aqm_first_above = 0;
+        return 0;
+    }
+    if (aqm_first_above == 0) {
+        aqm_first_above = now + aqm_interval * 1000LL;
+        return 0;
+    }
+    return now >= aqm_first_above;
+}
+
+/* drop or mark 'f' ('prev' is the frame before it), 0 if it is still there */
+static int aqm_signal(struct SQ_FRAME *f, struct SQ_FRAME *prev)
+{
+    if (mode_aqm == AQM_MARK) {
+        aqm_marks++;
+        return 0;
+    }
+
+    aqm_drops++;
+    dbg_warning("AQM: drop a frame queued for %.3f s\n", (now - f->ts) / 1000000.0);
+    sq_unlink(f, prev, NULL);
+    return 1;
+}
+
+/* CoDel dequeue decision, made once for each frame as it is about to start going out; 1 if dropped */
+static int aqm_dequeue(struct SQ_FRAME *f, struct SQ_FRAME *prev, int ahead)
+{
+    int ok;
+
+    f->judged = 1;
+    /* the control lane is not managed, it never builds a standing queue */
+    if (f->ctrl)
+        return 0;
+
+    ok = aqm_ok_to_drop(f, ahead);
+    if (aqm_dropping) {
+        if (!ok) {
+            aqm_dropping = 0;
+        } else if (now >= aqm_drop_next) {
+            aqm_count++;
+            aqm_drop_next = aqm_control_law(aqm_drop_next);
+            if (aqm_signal(f, prev))
+                return 1;
+        }
+    } else if (ok) {
+        /* drop faster right away if the last dropping state ended only recently */
+        aqm_dropping = 1;
+        aqm_count = aqm_count - aqm_last_count > 1 && now - aqm_drop_next < 16 * aqm_interval * 1000LL ?
+            aqm_count - aqm_last_count : 1;
+        aqm_last_count = aqm_count;
+        aqm_drop_next = aqm_control_law(now);
+        if (aqm_signal(f, prev))
+            return 1;
+    }
+
+    aqm_frames++;
+    aqm_sojourn += now - f->ts;
+    if (now - f->ts > aqm_max)
+        aqm_max = now - f->ts;
+    return 0;
+}
+
+static void aqm_dump(void)
+{
+    if (!mode_aqm || aqm_frames == 0)
+        return;
+
+    lprintf("AQM: %lld frames sent, sojourn avg %.3f s max %.3f s, %d dropped, %d marked\n", 
+        aqm_frames, aqm_sojourn / 1000000.0 / aqm_frames, aqm_max / 1000000.0, aqm_drops, aqm_marks);
+}
+
+/* send what the pacing allows from the sending queue */
+static void sq_send(void)
+{
+    unsigned char *buf[SQ_IOV];
+    int len[SQ_IOV];
+    struct SQ_FRAME *f, *prev;
+    int n, cnt, ahead, send_bytes;
+
+    /* one batch in flight at a time keeps the byte stream in order */
+    if (sq_inflight)
+        return;
+
+    tb_refill(sq_len() == 0);
+
+    n = sq_len();
+    if (!mode_stress && n > tb_credit / TB_BYTE)
+        n = (int)(tb_credit / TB_BYTE);
+    if (n == 0)
+        return;
+
+    /* a frame is judged by --aqm once it has the credit to start, wherever it is in the batch */
+    for (f = sq_head, prev = NULL, cnt = 0, ahead = 0; f && n > 0 && cnt < SQ_IOV; ) {
+        if (mode_aqm && !f->judged && aqm_dequeue(f, prev, ahead)) {
+            f = prev ? prev->next : sq_head;
+            continue;
+        }
+        buf[cnt] = f->data + f->sent;
+        len[cnt] = f->len - f->sent < n ? f->len - f->sent : n;
+        n -= len[cnt];
+        ahead += f->len - f->sent;
+        prev = f;
+        f = f->next;
+        cnt++;
+    }
+    if (cnt == 0)
+        return;
+
+    if (mode_uring) {
+        /* charged now, refunded by ur_sent() for what does not go out */
+        sq_inflight = ur_send(buf, len, cnt);
+        sq_inflight_frames = cnt;
+        tb_credit -= sq_inflight * TB_BYTE;
+        return;
+    }
+
+    send_bytes = mode_bond > 1 ? bond_write(buf, len, cnt) : send_sq_data(buf, len, cnt);
+    tb_credit -= send_bytes * TB_BYTE;
+    sq_consume(send_bytes);
+}
+
+/* the time sq_send() has earned a burst (or the whole queue), 0 if idle */
+static long long sq_pace_deadline(void)
+{
+    long long need;
+
+    /* --stress sends whenever the link takes more, see wait_deadline() */
+    if (sq_len() == 0 || mode_stress)
+        return 0;
+
+    need = (sq_len() < mode_burst ? sq_len() : mode_burst) * TB_BYTE;
+    if (tb_credit >= need)
+        return now;
+
+    return tb_ts + (need - tb_credit + chan_bps(chan_out()) - 1) / chan_bps(chan_out());
+}
+
+static void bond_send(void);
+
+static void socket_send(void)
+{
+    if (mode_bond > 1)
+        bond_send();
+    else
+        sq_send();
+}
+
+static long long pace_deadline(void)
+{
+    return mode_bond > 1 ? bond_pace_deadline() : sq_pace_deadline();
+}
+
+/* 
+   Free-list pools of fixed-size objects for the receiving path, so that
+   steady-state receiving never calls malloc()/free(). Objects are only
+   ever taken from the heap when the pool is empty and never given back.
+*/
+
+struct POOL {
+    const char *name;
+    int size;          /* object size, at least a pointer */
+    void *free_list;   /* linked through the first word of each object */
+    int used, high;    /* objects handed out now / at most */
+    int total;         /* objects allocated from the heap */
+};
+
+static void *pool_get(struct POOL *pool)
+{
+    void *obj = pool->free_list;
+
+    if (obj)
+        pool->free_list = *(void **)obj;
+    else {
+        if ((obj = malloc(pool->size)) == NULL)
+            ABORT("No enough memory");
+        pool->total++;
+    }
+
+    if (++pool->used > pool->high)
+        pool->high = pool->used;
+
+    return obj;
+}
+
+static void pool_put(struct POOL *pool, void *obj)
+{
+    *(void **)obj = pool->free_list;
+    pool->free_list = obj;
+    pool->used--;
+}
+
+static void pool_prealloc(struct POOL *pool, int n)
+{
+    void *obj;
+
+    while (pool->total < n) {
+        if ((obj = malloc(pool->size)) == NULL)
+            ABORT("No enough memory");
+        pool->total++;
+        *(void **)obj = pool->free_list;
+        pool->free_list = obj;
+    }
+}
+
+static void pool_report(struct POOL *pool)
+{
+    lprintf("Pool %-9s: %4d bytes/object, high water %d, %d allocated\n", 
+        pool->name, pool->size, pool->high, pool->total);
+}
+
+/* Physical Layer: Receiver */
+
+struct BLK {
+    long long commit_ts;
+    int rptr, wptr;
+    struct BLK *link;
+    unsigned char data[1]; /* blk_size bytes */
+};
+
+static struct BLK *rblk_head, *rblk_tail;
+static struct POOL blk_pool = { "BLK", sizeof(struct BLK), NULL, 0, 0, 0 };
+static unsigned int nbits;
+
+/* impose noise on a block sent at 'ts' and queue it for commit after the channel delay */
+static void rblk_queue(struct BLK *blk, long long ts)
+{
+    unsigned char *p;
+
+    nbits += blk->wptr * wire_bits;
+
+    /* Impose noise */
+    if (ber != 0.0) {
+        int a;
+        double rate, fact;
+
+        rate = (double)noise / nbits;
+        fact = rate > ber ? 3.5 : 6.0;
+        a = (int)((1.0 - pow(1.0 - ber, fact * blk->wptr * wire_bits / 4)) * (RAND_MAX + 1.0) + 0.5);
+        if (rand() <= a) {
+            p = &blk->data[rand() % blk->wptr];
+            if ((*p & 0x0f) || wire_bits != 4) {
+                *p ^= 1 << (rand() % 8);
+                noise++;
+                dbg_warning("Impose noise on received data, %u/%u=%.1E\n", noise, nbits, (double)noise / nbits);
+            }
+        }
+    }
+
+    blk->commit_ts = ts + chan_delay(chan_in(), ts) + bond_skew * bond_cur * 1000LL;
+    blk->link = NULL; 
+
+    if (rblk_head == NULL) 
+        rblk_head = rblk_tail = blk;
+    else {
+        rblk_tail->link = blk;
+        rblk_tail = blk;
+    }
+}
+
+static void rblk_append(struct BLK *blk, long long ts)
+{
+    if (mode_bond > 1)
+        bond_demux(blk, ts);
+    else
+        rblk_queue(blk, ts);
+}
+
+static void socket_recv(void)
+{
+    struct BLK *blk;
+
+    if (mode_sim) {
+        sim_recv();
+        return;
+    }
+
+    blk = (struct BLK *)pool_get(&blk_pool);
+
+    blk->rptr = 0;
+    if (mode_shm)
+        blk->wptr = shm_recv(blk->data, blk_size);
+    else
+        blk->wptr = SYSCALL(recv(sock, (char *)blk->data, blk_size, 0));
+    if (blk->wptr <= 0) {
+        pool_put(&blk_pool, blk);
+        link_lost();
+        return;
+    }
+
+    rblk_append(blk, now);
+}
+
+/* 
+   io_uring backend (--transport=uring)
+
+   The socket is never read or written by a system call of its own: a
+   multishot receive stays posted and the kernel picks the next free BLK
+   out of a provided-buffer ring for every chunk that arrives, each paced
+   batch goes out as a chain of linked sends, and waiting for the next
+   deadline is a timeout request. All of them share one io_uring_enter()
+   per loop iteration. BLKs still come from and go back to blk_pool; the
+   ring slot a BLK leaves is refilled with a fresh one at once.
+*/
+
+#ifdef HAVE_IO_URING
+
+#define UR_ENTRIES 128
+#define UR_NBUF    256  /* provided receive buffers, power of 2 */
+#define UR_BGID    0
+
+#define UR_RECV    1
+#define UR_TIMEOUT 2
+#define UR_SEND    0x100 /* + piece index */
+
+static int ur_fd = -1;
+static unsigned int *ur_sq_head, *ur_sq_tail, *ur_sq_mask, *ur_sq_array;
+static unsigned int *ur_cq_head, *ur_cq_tail, *ur_cq_mask;
+static struct io_uring_sqe *ur_sqes;
+static struct io_uring_cqe *ur_cqes;
+static unsigned int ur_pending;             /* SQEs not submitted yet */
+
+static struct io_uring_buf_ring *ur_br;
+static struct BLK *ur_blk[UR_NBUF];         /* buffer id -> BLK in the ring */
+static unsigned short ur_br_tail;
+static int ur_recv_armed;
+
+static int ur_send_n, ur_send_done, ur_send_len[SQ_IOV], ur_send_res[SQ_IOV];
+
+static int ur_enter(unsigned int to_submit, unsigned int min_complete)
+{
+    int ret;
+
+    ret = (int)SYSCALL(syscall(__NR_io_uring_enter, ur_fd, to_submit, min_complete, 
+        min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0));
+    if (ret < 0 && errno != EINTR && errno != ETIME)
+        ABORT("system io_uring_enter()");
+    if (ret > 0)
+        ur_pending -= ret;
+    return ret;
+}
+
+static struct io_uring_sqe *ur_get_sqe(void)
+{
+    unsigned int tail = *ur_sq_tail, idx;
+    struct io_uring_sqe *sqe;
+
+    if (tail - __atomic_load_n(ur_sq_head, __ATOMIC_ACQUIRE) > *ur_sq_mask) {
+        ur_enter(ur_pending, 0); /* full, make room */
+        if (tail - __atomic_load_n(ur_sq_head, __ATOMIC_ACQUIRE) > *ur_sq_mask)
+            ABORT("io_uring submission queue overflow");
+    }
+
+    idx = tail & *ur_sq_mask;
+    sqe = &ur_sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ur_sq_array[idx] = idx;
+    __atomic_store_n(ur_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ur_pending++;
+
+    return sqe;
+}
+
+static void ur_provide(int bid)
+{
+    struct io_uring_buf *buf = &ur_br->bufs[ur_br_tail & (UR_NBUF - 1)];
+
+    ur_blk[bid] = (struct BLK *)pool_get(&blk_pool);
+    buf->addr = (unsigned long long)(unsigned long)ur_blk[bid]->data;
+    buf->len = blk_size;
+    buf->bid = (unsigned short)bid;
+    ur_br_tail++;
+    __atomic_store_n(&ur_br->tail, ur_br_tail, __ATOMIC_RELEASE);
+}
+
+static void ur_arm_recv(void)
+{
+    struct io_uring_sqe *sqe = ur_get_sqe();
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sock;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = UR_BGID;
+    sqe->user_data = UR_RECV;
+    ur_recv_armed = 1;
+}
+
+static void ur_init(void)
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    unsigned char *sq, *cq;
+    size_t sq_size, cq_size;
+    int i;
+
+    memset(&p, 0, sizeof(p));
+    ur_fd = (int)syscall(__NR_io_uring_setup, UR_ENTRIES, &p);
+    if (ur_fd < 0)
+        ABORT("system io_uring_setup()");
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+        ABORT("io_uring is too old");
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > sq_size)
+        sq_size = cq_size;
+
+    sq = (unsigned char *)mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur_fd, IORING_OFF_SQ_RING);
+    ur_sqes = (struct io_uring_sqe *)mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), 
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur_fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || ur_sqes == MAP_FAILED)
+        ABORT("system mmap() of io_uring");
+    cq = sq;
+
+    ur_sq_head = (unsigned int *)(sq + p.sq_off.head);
+    ur_sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    ur_sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    ur_sq_array = (unsigned int *)(sq + p.sq_off.array);
+    ur_cq_head = (unsigned int *)(cq + p.cq_off.head);
+    ur_cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    ur_cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    ur_cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    /* receive buffers */
+    ur_br = (struct io_uring_buf_ring *)mmap(NULL, UR_NBUF * sizeof(struct io_uring_buf), 
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ur_br == MAP_FAILED)
+        ABORT("No enough memory");
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long long)(unsigned long)ur_br;
+    reg.ring_entries = UR_NBUF;
+    reg.bgid = UR_BGID;
+    if (syscall(__NR_io_uring_register, ur_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        ABORT("system io_uring_register() of receive buffers");
+    for (i = 0; i < UR_NBUF; i++)
+        ur_provide(i);
+
+    ur_arm_recv();
+    ur_enter(ur_pending, 0);
+}
+
+/* queue a batch as linked sends, they are submitted with the next wait */
+static int ur_send(unsigned char **buf, int *len, int cnt)
+{
+    struct io_uring_sqe *sqe;
+    int i, total = 0;
+
+    for (i = 0; i < cnt; i++) {
+        sqe = ur_get_sqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = sock;
+        sqe->addr = (unsigned long long)(unsigned long)buf[i];
+        sqe->len = len[i];
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        sqe->flags = i + 1 < cnt ? IOSQE_IO_LINK : 0;
+        sqe->user_data = UR_SEND + i;
+        ur_send_len[i] = len[i];
+        total += len[i];
+    }
+    ur_send_n = cnt;
+    ur_send_done = 0;
+
+    return total;
+}
+
+/* the whole batch has completed: bytes sent are the prefix up to the first short send */
+static void ur_sent(void)
+{
+    int i, bytes = 0;
+
+    for (i = 0; i < ur_send_n; i++) {
+        if (ur_send_res[i] > 0)
+            bytes += ur_send_res[i];
+        if (ur_send_res[i] != ur_send_len[i])
+            break;
+    }
+    if (bytes == 0 && ur_send_res[0] < 0 && ur_send_res[0] != -EINTR) {
+        lprintf("TCP Disconnected.\n");
+        exit(0);
+    }
+
+    tb_credit += (long long)(sq_inflight - bytes) * TB_BYTE;
+    sq_inflight = 0;
+    ur_send_n = 0;
+    sq_consume(bytes);
+}
+
+/* process all completions, returns 1 if any came from the socket */
+static int ur_reap(void)
+{
+    struct io_uring_cqe *cqe;
+    struct BLK *blk;
+    unsigned int head = *ur_cq_head;
+    int io = 0, bid;
+
+    while (head != __atomic_load_n(ur_cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = &ur_cqes[head & *ur_cq_mask];
+
+        if (cqe->user_data == UR_RECV) {
+            io = 1;
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                ur_recv_armed = 0;
+            if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+                bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                blk = ur_blk[bid];
+                ur_provide(bid);
+                blk->rptr = 0;
+                blk->wptr = cqe->res;
+                rblk_append(blk, now);
+            } else if (cqe->res == 0) {
+                lprintf("TCP disconnected.\n");
+                exit(0);
+            } else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -EINTR) {
+                lprintf("io_uring receive: %s\n", strerror(-cqe->res));
+                exit(0);
+            }
+        } else if (cqe->user_data >= UR_SEND && cqe->user_data < UR_SEND + SQ_IOV) {
+            io = 1;
+            ur_send_res[cqe->user_data - UR_SEND] = cqe->res;
+            if (++ur_send_done == ur_send_n)
+                ur_sent();
+        }
+        /* UR_TIMEOUT: nothing to do */
+
+        head++;
+    }
+    __atomic_store_n(ur_cq_head, head, __ATOMIC_RELEASE);
+
+    if (!ur_recv_armed)
+        ur_arm_recv();
+
+    return io;
+}
+
+/* submit what is queued and sleep until the deadline or a completion, 1 if woken by I/O */
+static int ur_wait(long long deadline)
+{
+    static struct __kernel_timespec ts;
+    struct io_uring_sqe *sqe;
+    long long us = deadline - get_us();
+
+    if (us <= 0) {
+        if (ur_pending)
+            ur_enter(ur_pending, 0);
+        return 0;
+    }
+
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = us % 1000000 * 1000;
+    sqe = ur_get_sqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (unsigned long long)(unsigned long)&ts;
+    sqe->len = 1;
+    sqe->off = 1; /* also completes on the first other completion */
+    sqe->user_data = UR_TIMEOUT;
+
+    ur_enter(ur_pending, 1);
+
+    return ur_reap();
+}
+
+/* hand queued sends to the kernel without waiting */
+static void ur_flush(void)
+{
+    if (ur_pending)
+        ur_enter(ur_pending, 0);
+}
+
+#else
+
+static int ur_send(unsigned char **buf, int *len, int cnt)
+{
+    return 0;
+}
+
+#define ur_reap()       0
+#define ur_wait(t)      0
+#define ur_flush()
+
+static void ur_init(void)
+{
+    ABORT("--transport=uring needs Linux with io_uring");
+}
+
+#endif
+
+
+/* 
+   Virtual-time Simulation (--sim) 
+
+   Both stations run on a virtual clock and exchange time-stamped records
+   instead of a raw byte stream, in a conservative lockstep: nothing the
+   peer sends at or after 'sim_peer_ts' can be committed here before
+   'sim_peer_ts' plus the channel delay, so the clock may jump straight to
+   the next deadline as long as it stays below that horizon. Otherwise the
+   station promises its peer it will not send anything earlier than its
+   own clock (an empty record) and waits for the peer's next record. The
+   channel delay is the lookahead that keeps both sides moving.
+*/
+
+struct SIM_REC {
+    long long ts;   /* virtual time the data left the sender */
+    int len;        /* bytes following, 0 for a bare time promise */
+    int reserved;
+};
+
+static long long sim_peer_ts, sim_promised;
+
+/* 
+   Peer records read off the socket ahead of sim_recv(). Both stations may
+   send while the other is not reading, so a sender that finds the socket
+   full keeps reading into here instead of blocking, or the two would block
+   each other. Records are still consumed strictly in sim_recv() order.
+*/
+static unsigned char *sim_in;
+static int sim_in_head, sim_in_tail, sim_in_size;
+
+#ifdef _WIN32
+#define sock_timeout() (WSAGetLastError() == WSAETIMEDOUT || WSAGetLastError() == WSAEWOULDBLOCK)
+#define SIM_DONTWAIT 0
+#else
+#define sock_timeout() (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+#define SIM_DONTWAIT MSG_DONTWAIT
+#endif
+
+static void sim_disconnected(void)
+{
+    lprintf("TCP disconnected.\n");
+    exit(0);
+}
+
+/* read what the peer has sent so far into the inbox */
+static void sim_fill(void)
+{
+    int n;
+
+    if (sim_in_head == sim_in_tail)
+        sim_in_head = sim_in_tail = 0;
+    if (sim_in_size - sim_in_tail < 4096) {
+        if (sim_in_head > 0) {
+            memmove(sim_in, sim_in + sim_in_head, sim_in_tail - sim_in_head);
+            sim_in_tail -= sim_in_head;
+            sim_in_head = 0;
+        }
+        if (sim_in_size - sim_in_tail < 4096) {
+            sim_in_size = sim_in_size ? sim_in_size * 2 : 64 * 1024;
+            if ((sim_in = (unsigned char *)realloc(sim_in, sim_in_size)) == NULL)
+                ABORT("No enough memory");
+        }
+    }
+
+    if (mode_shm) {
+        n = shm_recv(sim_in + sim_in_tail, sim_in_size - sim_in_tail);
+        if (n < 0) {
+            shm_wait(0, -1);
+            return;
+        }
+    } else
+        n = recv(sock, (char *)sim_in + sim_in_tail, sim_in_size - sim_in_tail, 0);
+    if (n < 0 && sock_timeout())
+        return;
+    if (n <= 0)
+        sim_disconnected();
+    sim_in_tail += n;
+}
+
+/* blocking read of exactly 'len' bytes of peer records */
+static void sim_read(void *buf, int len)
+{
+    int n;
+
+    while (len > 0) {
+        if (sim_in_head == sim_in_tail)
+            sim_fill();
+        n = sim_in_tail - sim_in_head < len ? sim_in_tail - sim_in_head : len;
+        memcpy(buf, sim_in + sim_in_head, n);
+        sim_in_head += n;
+        buf = (char *)buf + n;
+        len -= n;
+    }
+}
+
+/* send all 'len' bytes, reading the peer's records meanwhile if the socket is full */
+static void sim_write(void *buf, int len)
+{
+    fd_set rfds, wfds;
+    int n;
+
+    while (len > 0) {
+        if (mode_shm) {
+            unsigned char *p = (unsigned char *)buf;
+            if ((n = shm_sendv(&p, &len, 1)) < 0) {
+                shm_wait(1, -1);
+                if (shm_readable())
+                    sim_fill();
+                continue;
+            }
+        } else
+            n = send(sock, (char *)buf, len, SIM_DONTWAIT);
+        if (n > 0) {
+            buf = (char *)buf + n;
+            len -= n;
+            continue;
+        }
+        if (n == 0 || !sock_timeout())
+            sim_disconnected();
+
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        FD_SET(sock, &rfds);
+        FD_SET(sock, &wfds);
+        if (select(sock + 1, &rfds, &wfds, NULL, NULL) > 0 && FD_ISSET(sock, &rfds))
+            sim_fill();
+    }
+}
+
+static void sim_record(unsigned char **buf, int *len, int cnt)
+{
+    static unsigned char *out;
+    static int out_size;
+    struct SIM_REC rec;
+    int i, n;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.ts = sim_now;
+    for (i = 0; i < cnt; i++)
+        rec.len += len[i];
+
+    /* one send per record */
+    if (out_size < (int)sizeof(rec) + rec.len) {
+        out_size = sizeof(rec) + rec.len + 1024;
+        if ((out = (unsigned char *)realloc(out, out_size)) == NULL)
+            ABORT("No enough memory");
+    }
+    memcpy(out, &rec, sizeof(rec));
+    for (i = 0, n = sizeof(rec); i < cnt; n += len[i++])
+        memcpy(out + n, buf[i], len[i]);
+    sim_write(out, n);
+
+    sim_promised = sim_now;
+}
+
+static int sim_sendv(unsigned char **buf, int *len, int cnt)
+{
+    int i, n = 0;
+
+    sim_record(buf, len, cnt);
+    for (i = 0; i < cnt; i++)
+        n += len[i];
+    return n;
+}
+
+static void sim_recv(void)
+{
+    struct SIM_REC rec;
+    struct BLK *blk;
+
+    sim_read(&rec, sizeof(rec));
+    sim_peer_ts = rec.ts;
+
+    while (rec.len > 0) {
+        blk = (struct BLK *)pool_get(&blk_pool);
+
+        blk->rptr = 0;
+        blk->wptr = rec.len < blk_size ? rec.len : blk_size;
+        sim_read(blk->data, blk->wptr);
+        rec.len -= blk->wptr;
+
+        rblk_append(blk, rec.ts);
+    }
+}
+
+/* quit without resetting the connection, so the peer still reads everything we sent */
+static void sim_quit(void)
+{
+    char buf[256];
+    int n;
+
+    if (mode_shm) {
+        shm_close();
+        while ((n = shm_recv((unsigned char *)buf, sizeof(buf))) != 0)
+            if (n < 0)
+                shm_wait(0, -1);
+        return;
+    }
+
+    shutdown(sock, 1); /* SHUT_WR */
+    while ((n = recv(sock, buf, sizeof(buf), 0)) > 0 || (n < 0 && sock_timeout()))
+        ;
+}
+
+static void sim_advance(long long deadline)
+{
+    long long horizon = sim_peer_ts + chan_min_delay(chan_in(), sim_peer_ts);
+
+    if (deadline <= horizon) {
+        if (deadline > sim_now)
+            sim_now = deadline;
+        return;
+    }
+
+    if (horizon > sim_now)
+        sim_now = horizon;
+
+    if (sim_now > sim_promised)
+        sim_record(NULL, NULL, 0);
+
+    sim_recv();
+}
+
+/* Timer Management */
+
+/* 
+   Running timers are kept in an indexed binary min-heap ordered by deadline,
+   so the earliest expiry is at tm_heap[1] and start/stop cost O(log n).
+   Slot 0 is the ACK timer, data timer nr lives in slot nr + 1. 
+*/
+
+#define MAX_TIMER    65536
+#define ACK_TIMER_ID MAX_TIMER   /* 'arg' reported with ACK_TIMEOUT */
+
+static long long *tm_deadline;  /* deadline of each slot (us) */
+static int *tm_pos;       /* index of each slot in tm_heap[], 0 if stopped */
+static int *tm_heap;      /* 1-based heap of slots */
+static int tm_nslot, tm_count;
+
+#define tm_id(slot) ((slot) == 0 ? ACK_TIMER_ID : (slot) - 1)
+
+static int tm_before(int a, int b)
+{
+    if (tm_deadline[a] != tm_deadline[b])
+        return tm_deadline[a] < tm_deadline[b];
+    return tm_id(a) < tm_id(b);
+}
+
+static void tm_grow(int slot)
+{
+    int n = tm_nslot ? tm_nslot : 256;
+
+    if (slot < tm_nslot)
+        return;
+
+    while (n <= slot)
+        n *= 2;
+
+    tm_deadline = (long long *)realloc(tm_deadline, n * sizeof(long long));
+    tm_pos = (int *)realloc(tm_pos, n * sizeof(int));
+    tm_heap = (int *)realloc(tm_heap, (n + 1) * sizeof(int));
+    if (tm_deadline == NULL || tm_pos == NULL || tm_heap == NULL)
+        ABORT("No enough memory");
+
+    memset(tm_pos + tm_nslot, 0, (n - tm_nslot) * sizeof(int));
+    tm_nslot = n;
+}
+
+static void tm_place(int i, int slot)
+{
+    tm_heap[i] = slot;
+    tm_pos[slot] = i;
+}
+
+static void tm_sift_up(int i)
+{
+    int slot = tm_heap[i];
+
+    while (i > 1 && tm_before(slot, tm_heap[i / 2])) {
+        tm_place(i, tm_heap[i / 2]);
+        i /= 2;
+    }
+    tm_place(i, slot);
+}
+
+static void tm_sift_down(int i)
+{
+    int child, slot = tm_heap[i];
+
+    while ((child = i * 2) <= tm_count) {
+        if (child < tm_count && tm_before(tm_heap[child + 1], tm_heap[child]))
+            child++;
+        if (!tm_before(tm_heap[child], slot))
+            break;
+        tm_place(i, tm_heap[child]);
+        i = child;
+    }
+    tm_place(i, slot);
+}
+
+static void tm_start(int slot, long long deadline)
+{
+    tm_grow(slot);
+    tm_deadline[slot] = deadline;
+
+    if (tm_pos[slot] == 0) {
+        tm_place(++tm_count, slot);
+        tm_sift_up(tm_count);
+    } else {
+        tm_sift_up(tm_pos[slot]);
+        tm_sift_down(tm_pos[slot]);
+    }
+}
+
+static void tm_stop(int slot)
+{
+    int i, last;
+
+    if (slot >= tm_nslot || (i = tm_pos[slot]) == 0)
+        return;
+
+    tm_pos[slot] = 0;
+    last = tm_heap[tm_count--];
+    if (i <= tm_count) {
+        tm_place(i, last);
+        tm_sift_up(i);
+        tm_sift_down(tm_pos[last]);
+    }
+}
+
+static int tm_running(int slot)
+{
+    return slot < tm_nslot && tm_pos[slot] != 0;
+}
+
+void start_timer(unsigned int nr, unsigned int ms)
+{
+    if (nr >= MAX_TIMER) 
+        ABORT("start_timer(): timer No. must be 0~65535");
+    tm_start(nr + 1, now + (phl_sq_len() * 8000LL / (chan_bps(chan_out()) * mode_bond) + ms) * 1000);
+}
+
+void stop_timer(unsigned int nr)
+{
+    if (nr < MAX_TIMER) 
+        tm_stop(nr + 1);
+}
+
+int get_timer(unsigned int nr)
+{
+    if (nr >= MAX_TIMER || !tm_running(nr + 1))
+        return 0;
+    return tm_deadline[nr + 1] > now ? (int)((tm_deadline[nr + 1] - now + 999) / 1000) : 0;
+}
+
+void start_ack_timer(unsigned int ms)
+{
+    if (!tm_running(0))
+        tm_start(0, now + ms * 1000LL);
+}
+
+void stop_ack_timer(void)
+{
+    tm_stop(0);
+}
+
+/* deadline of the earliest running timer, 0 if none */
+static long long timer_deadline(void)
+{
+    return tm_count ? tm_deadline[tm_heap[1]] : 0;
+}
+
+static int scan_timer(int *nr)
+{
+    int slot;
+
+    if (tm_count == 0 || tm_deadline[tm_heap[1]] > now)
+        return 0;
+
+    slot = tm_heap[1];
+    tm_stop(slot);
+    *nr = tm_id(slot);
+    return slot == 0 ? ACK_TIMEOUT : DATA_TIMEOUT;
+}
+
+/* Network Layer Functions */
+
+static int network_layer_active = 0;
+static int rpackets, rbytes;
+
+void enable_network_layer(void)
+{
+    network_layer_active = 1;
+}
+
+void disable_network_layer(void)
+{
+    network_layer_active = 0;
+}
+
+static long long nl_last_ts = 0;
+static long long nl_idle_gap = 0; /* station B's pause in the IDLE phase, drawn once per packet */
+
+#define nl_idle(t) ((t) / 1000000 / mode_cycle % 2 != mode_ibib)
+
+static long long nl_gap(void)
+{
+    if (nl_idle_gap == 0)
+        nl_idle_gap = (4000 + rand() % 500) * 1000LL;
+    return nl_idle_gap;
+}
+
+/* station B holds its first packet until A's first frames may have arrived */
+static long long nl_start(void)
+{
+    return (chan[0].delay[0] + 3 * PKT_LEN * 8000 / chan[0].bps[1]) * 1000LL;
+}
+
+static int network_layer_ready(void)
+{
+    if (!network_layer_active)
+        return 0;
+
+    if (mode_flood) 
+        return 1;
+
+    if ((now - nl_last_ts) * chan_bps(chan_out()) * mode_bond / 8 / 1000000 < PKT_LEN * 3 / 4)
+        return 0;
+
+    if (station == 'b') {
+        if (nl_idle(now) && now - nl_last_ts < nl_gap())
+            return 0;
+        if (now < nl_start())
+            return 0;
+    }
+
+    nl_last_ts = now;
+    nl_idle_gap = 0;
+
+    return 1;
+}
+
+/* earliest time network_layer_ready() may turn true, 0 if it never will */
+static long long network_layer_deadline(void)
+{
+    long long t, cycle;
+
+    if (!network_layer_active)
+        return 0;
+
+    if (mode_flood)
+        return now;
+
+    t = nl_last_ts + (PKT_LEN * 3 / 4 * 8000000LL + chan_bps(chan_out()) * mode_bond - 1) / (chan_bps(chan_out()) * mode_bond);
+    if (t < now)
+        t = now;
+
+    if (station == 'b') {
+        if (t < nl_start())
+            t = nl_start();
+        /* in the IDLE phase: the end of the pause or of the phase, whichever comes first */
+        if (nl_idle(t) && t < nl_last_ts + nl_gap()) {
+            cycle = mode_cycle * 1000000LL;
+            t = t / cycle * cycle + cycle < nl_last_ts + nl_gap() ? t / cycle * cycle + cycle : nl_last_ts + nl_gap();
+        }
+    }
+    return t;
+}
+
+static int randA(void)
+{
+    static unsigned int holdrand = 0x65109bc4;
+    return ((holdrand = holdrand * 214013L + 2531011L) >> 16) & 0x7fff;
+}
+
+static int randB(void)
+{
+    static unsigned int holdrand = 0x1e459090;
+    return ((holdrand = holdrand * 214013L + 2531011L) >> 16) & 0x7fff;
+}
+
+#define next_char() ((unsigned char)(my_rand() & 0xff))
+
+static int layer3_ready = 0;
+
+int get_packet(unsigned char *packet)
+{
+    static int pkt_no = 0;
+    int i, len;
+    int (*my_rand)(void) = station == 'a' ? randA : randB;
+
+    if (!layer3_ready)
+        ABORT("get_packet(): Network layer is not ready for a new packet");
+    
+    if (replay_file)
+        len = replay_data('P', packet, PKT_LEN);
+    else {
+        len = PKT_LEN;
+        for (i = 2; i < len; i++)
+            packet[i] = next_char();
+        *(unsigned short *)packet = (station - 'a' + 1) * 10000 + (pkt_no++ % 10000);
+    }
+
+    if (record_file)
+        record_data('P', packet, len);
+
+    layer3_ready = 0;
+
+    return len;
+}
+
+static long long ts0;
+
+void put_packet(unsigned char *packet, int len)
+{
+    static long long last_ts = 0;
+    int i, (*my_rand)(void) = station == 'a' ? randB : randA;
+
+    if (len != PKT_LEN) 
+        ABORT("Bad Packet length");
+
+    for (i = 2; i < PKT_LEN; i++) {
+        if (packet[i] != next_char()) 
+            ABORT("Network Layer received a bad packet from data link layer");
+    }
+    rpackets++;
+    rbytes += len;
+
+    if (now - last_ts > 2000000 && now > ts0 + 2000000) {
+        double bps;
+        bps = (double)rbytes * 8 * 1000000 / (now - ts0);
+        /* against what the incoming direction could carry over the same time */
+        lprintf(".... %d packets received, %.0f bps, %.2f%%, Err %d (%.1e)\n", 
+            rpackets, bps, (double)rbytes * 8 * 1000000 / (chan_bits(chan_in(), ts0, now) * mode_bond) * 100, 
+            noise, nbits ? (double)noise/nbits : 0.0);
+        last_ts = now;
+    }
+}
+
+/* cost of what this station received under --stress */
+static void stress_dump(void)
+{
+    double secs = get_us() / 1000000.0, cpu = (double)clock() / CLOCKS_PER_SEC;
+
+    if (!mode_stress || rpackets == 0 || secs <= 0)
+        return;
+
+    lprintf("Stress: %d packets in %.3f s, %.0f packets/s, %.3f CPU-s per million packets, "
+        "%.2f system calls per packet\n", rpackets, secs, rpackets / secs, 
+        cpu * 1000000 / rpackets, (double)(nsyscalls + io_nsyscalls) / rpackets);
+}
+
+#define DBG_EVENT    0x01
+#define DBG_FRAME    0x02
+#define DBG_WARNING  0x04
+
+void dbg_event(char *fmt, ...)
+{
+	va_list arg_ptr;
+
+	if (debug_mask & DBG_FRAME) {
+		va_start(arg_ptr, fmt);
+		__v_lprintf(fmt, arg_ptr);
+		va_end(arg_ptr);
+	}
+}
+
+void dbg_frame(char *fmt, ...)
+{
+	va_list arg_ptr;
+
+	if (debug_mask & DBG_FRAME) {
+		va_start(arg_ptr, fmt);
+		__v_lprintf(fmt, arg_ptr);
+		va_end(arg_ptr);
+	}
+}
+
+void dbg_warning(char *fmt, ...)
+{
+	va_list arg_ptr;
+
+	if (debug_mask & DBG_WARNING) {
+		va_start(arg_ptr, fmt);
+		__v_lprintf(fmt, arg_ptr);
+		va_end(arg_ptr);
+	}
+}
+
+/* Event Generator */
+
+#define PHL_SQ_LEVEL  50 /* per channel of the link */
+
+/* 
+   Longest frame delivered, see protocol.h. The buffer has room for the
+   encoding overhead of a codec that unstuffs in place.
+*/
+#define RF_MAX_FRAME MAX_FRAME_LEN
+#define RF_FRAME_LEN (PKT_LEN + 16)
+
+struct RCV_FRAME {
+    int len;
+    int state;
+    unsigned int crc; /* of frame[0..len-1] */
+    unsigned char frame[RF_FRAME_LEN];
+    struct RCV_FRAME *link;
+};
+
+static struct RCV_FRAME *rf_head, *rf_tail, *rf_buf;
+static struct POOL rf_pool = { "RCV_FRAME", sizeof(struct RCV_FRAME), NULL, 0, 0, 0 };
+static int rf_count;     /* frames in the receiving queue */
+static int rf_announced; /* ... of which FRAME_RECEIVED has been reported */
+
+int recv_frame(unsigned char *buf, int size)
+{
+    int len;
+    struct RCV_FRAME *next;
+    char msg[256];
+
+    if (replay_file)
+        return replay_data('F', buf, size);
+
+    if (rf_head == NULL) 
+        ABORT("recv_frame(): Receiving Queue is empty");
+
+    len = rf_head->len;
+
+    if (size < len) { 
+        sprintf(msg, "recv_frame(): %d-byte buffer is too small to save %d-byte received frame", size, len);
+        ABORT(msg);
+    }
+    
+    memcpy(buf, rf_head->frame, len);
+
+    next = rf_head->link;
+    if (next == NULL) 
+        rf_tail = NULL;
+    if (mode_threads)
+        io_release(rf_head);
+    else
+        pool_put(&rf_pool, rf_head); 
+    rf_head = next;
+
+    rf_count--;
+    if (rf_announced > 0)
+        rf_announced--;
+
+    if (record_file)
+        record_data('F', buf, len);
+
+    return len;
+}
+
+int recv_frame_crc(unsigned char *buf, int size, int *crc_ok)
+{
+    int len;
+
+    if (replay_file) {
+        len = replay_data('F', buf, size);
+        *crc_ok = len >= 5 && crc32(buf, len) == 0;
+        return len;
+    }
+
+    /* the CRC over a frame followed by its CRC leaves 0 */
+    *crc_ok = rf_head && rf_head->len >= 5 && rf_head->crc == 0;
+
+    return recv_frame(buf, size);
+}
+
+static void pool_init(void)
+{
+    blk_pool.size = (int)sizeof(struct BLK) - 1 + blk_size;
+    if (mode_pool > 0) {
+        pool_prealloc(&blk_pool, mode_pool);
+        pool_prealloc(&rf_pool, mode_pool);
+    }
+}
+
+static void pool_dump(void)
+{
+    if (mode_pool < 0)
+        return;
+    pool_report(&blk_pool);
+    pool_report(&rf_pool);
+}
+
+/* Deadline-driven sleeping (--wait) */
+
+static long long next_deadline(void)
+{
+    long long t, deadline = now + 1000000; /* wake up at least once a second */
+
+#define EARLIER(t) do { if ((t) && (t) < deadline) deadline = (t); } while (0)
+
+    t = timer_deadline();
+    EARLIER(t);
+
+    /* under --threads both belong to the I/O thread */
+    if (!mode_threads) {
+        t = rblk_deadline();
+        EARLIER(t);
+
+        t = pace_deadline();
+        EARLIER(t);
+    }
+
+    t = network_layer_deadline();
+    EARLIER(t);
+
+    /* credit earned up to a rate change is worth a different amount after it */
+    t = chan_next();
+    EARLIER(t);
+
+    EARLIER(mode_life + 1);
+
+#undef EARLIER
+
+    return deadline;
+}
+
+/* 
+   Wakeup lateness histogram: bucket i counts wakeups 2^(i-1)..2^i - 1 us
+   after the deadline they were scheduled for (bucket 0: on time). 
+*/
+
+#define NLATE 24
+
+static unsigned int late_hist[NLATE];
+static long long late_sum, late_max;
+static unsigned int late_cnt;
+
+static void lateness_record(long long us)
+{
+    int i;
+
+    if (us < 0)
+        us = 0;
+
+    for (i = 0; i < NLATE - 1 && (us >> i) != 0; i++)
+        ;
+    late_hist[i]++;
+    late_cnt++;
+    late_sum += us;
+    if (us > late_max)
+        late_max = us;
+}
+
+static void lateness_dump(void)
+{
+    int i;
+
+    if (late_cnt == 0)
+        return;
+
+    lprintf("Wakeup lateness: %u wakeups, mean %lld us, max %lld us\n", 
+        late_cnt, late_sum / late_cnt, late_max);
+    for (i = 0; i < NLATE; i++) {
+        if (late_hist[i] == 0)
+            continue;
+        if (i == 0)
+            lprintf("    %8s us : %8u  %6.2f%%\n", "0", late_hist[i], late_hist[i] * 100.0 / late_cnt);
+        else
+            lprintf("    %8lld+ us : %7u  %6.2f%%\n", 1LL << (i - 1), late_hist[i], late_hist[i] * 100.0 / late_cnt);
+    }
+}
+
+/* wait_deadline() returns 1 if woken up early by socket data */
+
+#ifdef __linux__
+
+static int wait_deadline(long long deadline)
+{
+    static int epfd = -1, tfd = -1;
+    struct epoll_event ev;
+    struct itimerspec its;
+    unsigned long long expirations;
+    long long us;
+    int want_out;
+    static int wanting_out;
+
+    if (mode_shm) {
+        us = deadline - get_us();
+        return us > 0 && shm_wait(mode_stress && sq_total() > 0, us);
+    }
+    if (mode_uring)
+        return ur_wait(deadline);
+    if (mode_threads)
+        return io_wait(deadline);
+
+    if (epfd < 0) {
+        epfd = epoll_create1(0);
+        tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        if (epfd < 0 || tfd < 0)
+            ABORT("system epoll_create1()/timerfd_create()");
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = sock;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) < 0)
+            ABORT("system epoll_ctl()");
+        ev.data.fd = tfd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev) < 0)
+            ABORT("system epoll_ctl()");
+    }
+
+    us = deadline - get_us();
+    if (us <= 0)
+        return 0;
+
+    /* unpaced, a backlog waits for room in the socket */
+    want_out = mode_stress && sq_total() > 0;
+    if (want_out != wanting_out) {
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | (want_out ? EPOLLOUT : 0);
+        ev.data.fd = sock;
+        if (SYSCALL(epoll_ctl(epfd, EPOLL_CTL_MOD, sock, &ev)) < 0)
+            ABORT("system epoll_ctl()");
+        wanting_out = want_out;
+    }
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = us / 1000000;
+    its.it_value.tv_nsec = us % 1000000 * 1000;
+    SYSCALL(timerfd_settime(tfd, 0, &its, NULL));
+
+    if (SYSCALL(epoll_wait(epfd, &ev, 1, -1)) < 0) {
+        if (errno != EINTR)
+            ABORT("system epoll_wait()");
+        return 1;
+    }
+
+    SYSCALL(read(tfd, &expirations, sizeof(expirations)));
+
+    return ev.data.fd == sock;
+}
+
+#else
+
+static int wait_deadline(long long deadline)
+{
+    fd_set rfd, wfd;
+    struct timeval tm;
+    long long us;
+    int n;
+
+    us = deadline - get_us();
+    if (us <= 0)
+        return 0;
+
+    tm.tv_sec = (long)(us / 1000000);
+    tm.tv_usec = (long)(us % 1000000);
+    FD_ZERO(&rfd);
+    FD_ZERO(&wfd);
+    FD_SET(sock, &rfd);
+    /* unpaced, a backlog waits for room in the socket */
+    if (mode_stress && sq_total() > 0)
+        FD_SET(sock, &wfd);
+
+    if ((n = SYSCALL(select(sock + 1, &rfd, &wfd, 0, &tm))) < 0) 
+        ABORT("system select()");
+
+    return n > 0;
+}
+
+#endif
+
+/* 
+   Framing Codecs 
+
+   How a frame is put on the wire, chosen by --codec and agreed on by both
+   stations at connect time. Each codec says how many channel bits one wire
+   byte costs, the pacing, the noise and the statistics all follow it:
+
+   nibble: 0xff, each byte as two 4-bit wire bytes (low nibble first), 0xff.
+           A wire byte costs 4 bits, so the cost is the frame plus one byte.
+   cobs:   Consistent Overhead Byte Stuffing, delimited by 0x00. 8 bits per
+           wire byte, about one byte in 254 plus the delimiter of overhead.
+   hdlc:   0x7e flags around the bits of the frame, a 0 stuffed after five 1s
+           in a row, padded with 1s to the next byte. 8 bits per wire byte.
+
+   The decoders are fed whole received blocks and finish frames into the
+   receiving queue through rf_open()/rf_put()/rf_close(). Like the nibble
+   decoder always did, damaged frames are delivered and left to the CRC,
+   which the decoders keep up to date in rf_buf->crc as bytes come out.
+   Given a 'crc', the encoders fold the frame into it as they go and send
+   the result after the frame.
+*/
+
+#define CODEC_NIBBLE 1
+#define CODEC_COBS   2
+#define CODEC_HDLC   3
+
+struct CODEC {
+    int id;
+    const char *name;
+    int wire_bits;
+    int (*max_wire)(int len);
+    int (*encode)(unsigned char *out, const unsigned char *frame, int len, unsigned int *crc);
+    void (*decode)(const unsigned char *p, int n);
+};
+
+static void rf_open(void)
+{
+    if (rf_buf == NULL) {
+        rf_buf = (struct RCV_FRAME *)pool_get(&rf_pool);
+        rf_buf->link = NULL;
+    }
+    rf_buf->len = rf_buf->state = 0;
+    rf_buf->crc = CRC32_INIT;
+}
+
+static void rf_put(unsigned char ch)
+{
+    if (rf_buf && rf_buf->len < RF_FRAME_LEN)
+        rf_buf->frame[rf_buf->len++] = ch;
+}
+
+/* byte 'i' of a frame and then of the CRC after it, the frame bytes go into the CRC */
+static unsigned char frame_byte(const unsigned char *frame, int len, int i, unsigned int *crc)
+{
+    if (i >= len)
+        return (unsigned char)(*crc >> 8 * (i - len));
+    if (crc)
+        *crc = crc32_update(*crc, frame + i, 1);
+    return frame[i];
+}
+
+/* queue the frame collected so far, if any */
+static void rf_close(void)
+{
+    if (rf_buf == NULL || rf_buf->len == 0)
+        return;
+    if (rf_buf->len > RF_MAX_FRAME) {
+        pool_put(&rf_pool, rf_buf);
+        rf_buf = NULL;
+        return;
+    }
+
+    if (mode_threads) {
+        /* handed over to the protocol thread */
+        io_deliver(rf_buf);
+        rf_buf = NULL;
+        return;
+    }
+
+    if (rf_head == NULL) 
+        rf_head = rf_tail = rf_buf;
+    else {
+        rf_tail->link = rf_buf;
+        rf_tail = rf_buf;
+    }
+    rf_count++;
+    rf_buf = NULL;
+}
+
+/* 
+   nibble 
+
+   Every frame byte is split into two wire bytes and paired up again on
+   the other side, so the splitting, the pairing and the search for the
+   0xff flags have SSE2/AVX2 kernels, picked by nibble_pick() for the CPU
+   at hand. Each kernel does what the plain C one does, byte for byte.
+*/
+
+struct NIBBLE_KERNEL {
+    const char *name;
+    /* 'len' frame bytes to 2 * len wire bytes */
+    void (*split)(unsigned char *out, const unsigned char *in, int len);
+    /* wire byte pairs up to the first 0xff, returns wire bytes used */
+    int (*join)(unsigned char *out, const unsigned char *in, int n);
+    /* offset of the first 0xff, n if none */
+    int (*flag)(const unsigned char *in, int n);
+};
+
+static void split_c(unsigned char *out, const unsigned char *in, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        *out++ = in[i] & 0x0f;
+        *out++ = (in[i] & 0xf0) >> 4;
+    }
+}
+
+static int join_c(unsigned char *out, const unsigned char *in, int n)
+{
+    int i;
 
-    get_ms();
+    for (i = 0; i + 1 < n && in[i] != 0xff && in[i + 1] != 0xff; i += 2)
+        *out++ = in[i] | ((in[i + 1] << 4) ^ (in[i + 1] & 0xf0));
+
+    return i;
 }
 
-/* Physical Layer: Sender */
+static int flag_c(const unsigned char *in, int n)
+{
+    const unsigned char *p = (const unsigned char *)memchr(in, 0xff, n);
 
-/* Sending queue structure */
+    return p ? (int)(p - in) : n;
+}
 
-#define SQ_SIZE (128 * 1024) 
+static const struct NIBBLE_KERNEL nk_c = { "c", split_c, join_c, flag_c };
 
-static unsigned char sq[SQ_SIZE];
-static int sq_head, sq_tail;
-static int inform_phl_ready = 1;
+#ifdef HAVE_X86_SIMD
 
-#define sq_inc(p, n) (p = (p + n) % SQ_SIZE)
+static int lowest_bit(unsigned int mask)
+{
+#ifdef _MSC_VER
+    unsigned long i;
 
-static int send_bytes_allowed = 0;
+    _BitScanForward(&i, mask);
+    return (int)i;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
 
-static int sq_len(void)
+TARGET("sse2") static void split_sse2(unsigned char *out, const unsigned char *in, int len)
 {
-    return (sq_tail + SQ_SIZE - sq_head) % SQ_SIZE;
+    const __m128i m = _mm_set1_epi8(0x0f);
+    __m128i v, lo, hi;
+    int i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)(in + i));
+        lo = _mm_and_si128(v, m);
+        hi = _mm_and_si128(_mm_srli_epi16(v, 4), m);
+        _mm_storeu_si128((__m128i *)(out + 2 * i), _mm_unpacklo_epi8(lo, hi));
+        _mm_storeu_si128((__m128i *)(out + 2 * i + 16), _mm_unpackhi_epi8(lo, hi));
+    }
+    split_c(out + 2 * i, in + i, len - i);
 }
 
-int phl_sq_len(void)
+/* wire byte pairs in 16-bit lanes to frame bytes in the low halves */
+TARGET("sse2") static __m128i join_pairs_sse2(__m128i v)
 {
-    return sq_len();
+    __m128i lo = _mm_and_si128(v, _mm_set1_epi16(0x00ff));
+    __m128i hi = _mm_srli_epi16(v, 8);
+
+    hi = _mm_and_si128(_mm_xor_si128(_mm_slli_epi16(hi, 4), hi), _mm_set1_epi16(0x00f0));
+    return _mm_or_si128(lo, hi);
 }
 
-static void send_byte(unsigned char byte)
+TARGET("sse2") static int join_sse2(unsigned char *out, const unsigned char *in, int n)
 {
-    inform_phl_ready = 1;
+    const __m128i ff = _mm_set1_epi8(-1);
+    __m128i a, b;
+    int i;
 
-    if (send_bytes_allowed && sq_head == sq_tail) {
-        send(sock, (char *)&byte, 1, 0);
-        send_bytes_allowed--;
-        return;
+    for (i = 0; i + 32 <= n; i += 32) {
+        a = _mm_loadu_si128((const __m128i *)(in + i));
+        b = _mm_loadu_si128((const __m128i *)(in + i + 16));
+        if (_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(a, ff), _mm_cmpeq_epi8(b, ff))))
+            break;
+        _mm_storeu_si128((__m128i *)(out + i / 2),
+            _mm_packus_epi16(join_pairs_sse2(a), join_pairs_sse2(b)));
     }
 
-    if (sq_len() == SQ_SIZE - 1)
-        ABORT("Physical Layer Sending Queue overflow");
+    return i + join_c(out + i / 2, in + i, n - i);
+}
+
+TARGET("sse2") static int flag_sse2(const unsigned char *in, int n)
+{
+    const __m128i ff = _mm_set1_epi8(-1);
+    unsigned int mask;
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(in + i)), ff));
+        if (mask)
+            return i + lowest_bit(mask);
+    }
 
-    sq[sq_tail] = byte;
-    sq_inc(sq_tail, 1);
+    return i + flag_c(in + i, n - i);
 }
 
-void send_frame(unsigned char *frame, int len)
+static const struct NIBBLE_KERNEL nk_sse2 = { "sse2", split_sse2, join_sse2, flag_sse2 };
+
+/* the AVX2 unpack and pack work within 128-bit lanes, the permutes put the halves in order */
+
+TARGET("avx2") static void split_avx2(unsigned char *out, const unsigned char *in, int len)
 {
+    const __m256i m = _mm256_set1_epi8(0x0f);
+    __m256i v, lo, hi, a, b;
     int i;
 
-    send_byte(0xff);
-    
-    for (i = 0; i < len; i++) {
-        send_byte(frame[i] & 0x0f);
-        send_byte((frame[i] & 0xf0) >> 4);
+    for (i = 0; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *)(in + i));
+        lo = _mm256_and_si256(v, m);
+        hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), m);
+        a = _mm256_unpacklo_epi8(lo, hi);
+        b = _mm256_unpackhi_epi8(lo, hi);
+        _mm256_storeu_si256((__m256i *)(out + 2 * i), _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256((__m256i *)(out + 2 * i + 32), _mm256_permute2x128_si256(a, b, 0x31));
     }
-    send_byte(0xff);
+    split_sse2(out + 2 * i, in + i, len - i);
 }
 
-static int send_sq_data(unsigned int start, unsigned int end1)
+TARGET("avx2") static __m256i join_pairs_avx2(__m256i v)
 {
-    int ret;
+    __m256i lo = _mm256_and_si256(v, _mm256_set1_epi16(0x00ff));
+    __m256i hi = _mm256_srli_epi16(v, 8);
 
-    if (start >= end1) 
-        return 0;
+    hi = _mm256_and_si256(_mm256_xor_si256(_mm256_slli_epi16(hi, 4), hi), _mm256_set1_epi16(0x00f0));
+    return _mm256_or_si256(lo, hi);
+}
 
-    ret = send(sock, (char *)&sq[start], end1 - start, 0);
-    if (ret <= 0) {
-        lprintf("TCP Disconnected.\n");
-        exit(0);
+TARGET("avx2") static int join_avx2(unsigned char *out, const unsigned char *in, int n)
+{
+    const __m256i ff = _mm256_set1_epi8(-1);
+    __m256i a, b;
+    int i;
+
+    for (i = 0; i + 64 <= n; i += 64) {
+        a = _mm256_loadu_si256((const __m256i *)(in + i));
+        b = _mm256_loadu_si256((const __m256i *)(in + i + 32));
+        if (_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(a, ff), _mm256_cmpeq_epi8(b, ff))))
+            break;
+        _mm256_storeu_si256((__m256i *)(out + i / 2), _mm256_permute4x64_epi64(
+            _mm256_packus_epi16(join_pairs_avx2(a), join_pairs_avx2(b)), 0xd8));
     }
 
-    return ret;
+    return i + join_sse2(out + i / 2, in + i, n - i);
 }
 
-static void socket_send(void)
+TARGET("avx2") static int flag_avx2(const unsigned char *in, int n)
 {
-    static int last_ts = 0;
-    int n, send_tail = sq_head, send_bytes;
+    const __m256i ff = _mm256_set1_epi8(-1);
+    unsigned int mask;
+    int i;
 
-    if (last_ts == 0) 
-        last_ts = now;
+    for (i = 0; i + 32 <= n; i += 32) {
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(in + i)), ff));
+        if (mask)
+            return i + lowest_bit(mask);
+    }
 
-    if (now <= last_ts) 
-        return;
+    return i + flag_sse2(in + i, n - i);
+}
 
-    send_bytes_allowed = (now - last_ts) * CHAN_BPS / 8 / 1000 * 2;
-    n = sq_len();
-    if (n > send_bytes_allowed)
-        n = send_bytes_allowed;
-    sq_inc(send_tail, n);
+static const struct NIBBLE_KERNEL nk_avx2 = { "avx2", split_avx2, join_avx2, flag_avx2 };
+
+#endif
+
+static const struct NIBBLE_KERNEL *nk = &nk_c;
+
+static const struct NIBBLE_KERNEL *nibble_pick(void)
+{
+#ifdef HAVE_X86_SIMD
+#ifdef _MSC_VER
+    int r[4];
+
+    __cpuid(r, 1);
+    /* AVX2 needs the OS to save the YMM registers too */
+    if ((r[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6) {
+        int r7[4];
+
+        __cpuidex(r7, 7, 0);
+        if (r7[1] & (1 << 5))
+            return &nk_avx2;
+    }
+    if (r[3] & (1 << 26))
+        return &nk_sse2;
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return &nk_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return &nk_sse2;
+#endif
+#endif
+    return &nk_c;
+}
+
+static int nibble_max_wire(int len)
+{
+    return 2 * len + 2;
+}
+
+static int nibble_encode(unsigned char *out, const unsigned char *frame, int len, unsigned int *crc)
+{
+    unsigned char tail[4];
+    int i, k;
 
-    if (send_tail >= sq_head) 
-        send_bytes = send_sq_data(sq_head, send_tail);
+    out[0] = 0xff;
+    if (crc == NULL)
+        nk->split(out + 1, frame, len);
     else {
-        send_bytes = send_sq_data(sq_head, SQ_SIZE);
-        send_bytes += send_sq_data(0, send_tail);
+        /* take the CRC of each stretch right before splitting it, while it is in the cache */
+        *crc = CRC32_INIT;
+        for (i = 0; i < len; i += k) {
+            k = len - i < 64 ? len - i : 64;
+            *crc = crc32_update(*crc, frame + i, k);
+            nk->split(out + 1 + 2 * i, frame + i, k);
+        }
+        for (i = 0; i < 4; i++)
+            tail[i] = frame_byte(frame, len, len + i, crc);
+        split_c(out + 1 + 2 * len, tail, 4);
+        len += 4;
     }
+    out[2 * len + 1] = 0xff;
 
-    sq_inc(sq_head, send_bytes);
-    send_bytes_allowed -= send_bytes;
+    return 2 * len + 2;
+}
 
-    last_ts = now;
+static void nibble_byte(unsigned char ch)
+{
+    if (ch == 0xff) {
+        if (rf_buf == NULL) 
+            rf_open();
+        else if (rf_buf->len > 0) 
+            rf_close();
+    } else if (rf_buf && rf_buf->len < RF_FRAME_LEN) {
+        if (rf_buf->state == 0) {
+            rf_buf->frame[rf_buf->len] = ch;
+            rf_buf->state = 1;
+        } else {
+            rf_buf->frame[rf_buf->len] |= (ch << 4) ^ (ch & 0xf0);
+            rf_buf->crc = crc32_update(rf_buf->crc, rf_buf->frame + rf_buf->len, 1);
+            rf_buf->len++;
+            rf_buf->state = 0;
+        }
+    }
 }
 
-/* Physical Layer: Receiver */
+static void nibble_decode(const unsigned char *p, int n)
+{
+    int k;
+
+    while (n > 0) {
+        if (rf_buf == NULL || rf_buf->len == RF_FRAME_LEN) {
+            /* nothing to collect up to the next flag */
+            k = nk->flag(p, n);
+        } else if (rf_buf->state == 0) {
+            /* whole pairs up to the next flag, as far as the frame has room */
+            k = n < 2 * (RF_FRAME_LEN - rf_buf->len) ? n : 2 * (RF_FRAME_LEN - rf_buf->len);
+            k = nk->join(rf_buf->frame + rf_buf->len, p, k);
+            rf_buf->crc = crc32_update(rf_buf->crc, rf_buf->frame + rf_buf->len, k / 2);
+            rf_buf->len += k / 2;
+        } else 
+            k = 0;
+        p += k;
+        n -= k;
+
+        /* a flag, an odd nibble or a byte the frame has no room for */
+        if (n > 0) {
+            nibble_byte(*p++);
+            n--;
+        }
+    }
+}
 
-#define BLKSIZE (16 * CHAN_BPS / 8 / (1000 / DEFAULT_TICK))
+/* cobs */
 
-struct BLK {
-    int commit_ts;
-    int rptr, wptr;
-    struct BLK *link;
-    unsigned char data[BLKSIZE];
-};
+static int cobs_max_wire(int len)
+{
+    return len + len / 254 + 2;
+}
 
-static struct BLK *rblk_head, *rblk_tail;
-static unsigned int nbits;
+static int cobs_encode(unsigned char *out, const unsigned char *frame, int len, unsigned int *crc)
+{
+    unsigned char *code = out, *p = out + 1, ch;
+    int i, n = len;
 
-static void socket_recv(void)
+    if (crc) {
+        *crc = CRC32_INIT;
+        n += 4;
+    }
+    for (i = 0; i < n; i++) {
+        ch = frame_byte(frame, len, i, crc);
+        if (ch == 0) {
+            *code = (unsigned char)(p - code);
+            code = p++;
+        } else {
+            *p++ = ch;
+            if (p - code == 0xff) {
+                *code = 0xff;
+                code = p++;
+            }
+        }
+    }
+    *code = (unsigned char)(p - code);
+    *p++ = 0;
+
+    return (int)(p - out);
+}
+
+static void cobs_byte(unsigned char ch)
 {
-    struct BLK *blk;
+    unsigned char *f;
+    unsigned int crc = CRC32_INIT;
+    int i, o, o0, code, k;
+
+    if (ch != 0) {
+        if (rf_buf == NULL)
+            rf_open();
+        rf_put(ch);
+        return;
+    }
+    if (rf_buf == NULL)
+        return;
+
+    /* unstuff in place, the output never overtakes the input */
+    f = rf_buf->frame;
+    for (i = o = 0; i < rf_buf->len; ) {
+        o0 = o;
+        code = f[i++];
+        for (k = 1; k < code && i < rf_buf->len; k++)
+            f[o++] = f[i++];
+        if (code != 0xff && i < rf_buf->len)
+            f[o++] = 0;
+        crc = crc32_update(crc, f + o0, o - o0);
+    }
+    rf_buf->len = o;
+    rf_buf->crc = crc;
+    rf_close();
+    if (rf_buf)
+        rf_buf->len = 0;
+}
+
+static void cobs_decode(const unsigned char *p, int n)
+{
+    while (n-- > 0)
+        cobs_byte(*p++);
+}
+
+/* hdlc */
+
+static int hdlc_max_wire(int len)
+{
+    return (len * 8 * 6 / 5 + 16 + 7) / 8 + 1;
+}
+
+struct BITW {
     unsigned char *p;
+    int nbit;
+};
 
-    blk = (struct BLK *)malloc(sizeof(struct BLK));
-    if (blk == NULL) 
-        ABORT("No enough memory");
+static void bitw_put(struct BITW *w, int bit)
+{
+    if (w->nbit == 0)
+        *w->p = 0;
+    if (bit)
+        *w->p |= 1 << w->nbit;
+    if (++w->nbit == 8) {
+        w->p++;
+        w->nbit = 0;
+    }
+}
 
-    blk->rptr = 0;
-    blk->wptr = recv(sock, (char *)blk->data, BLKSIZE, 0);
-    if (blk->wptr <= 0) {
-        lprintf("TCP disconnected.\n");
-        exit(0);
+static int hdlc_encode(unsigned char *out, const unsigned char *frame, int len, unsigned int *crc)
+{
+    struct BITW w;
+    unsigned char ch;
+    int i, b, ones = 0, n = len;
+
+    w.p = out;
+    w.nbit = 0;
+    if (crc) {
+        *crc = CRC32_INIT;
+        n += 4;
     }
-    nbits += blk->wptr * 4;
 
-    /* Impose noise */
-    if (ber != 0.0) {
-        int a;
-        double rate, fact;
+    for (b = 0; b < 8; b++)
+        bitw_put(&w, (0x7e >> b) & 1);
+    for (i = 0; i < n; i++) {
+        ch = frame_byte(frame, len, i, crc);
+        for (b = 0; b < 8; b++) {
+            bitw_put(&w, (ch >> b) & 1);
+            if ((ch >> b) & 1) {
+                if (++ones == 5) {
+                    bitw_put(&w, 0);
+                    ones = 0;
+                }
+            } else
+                ones = 0;
+        }
+    }
+    for (b = 0; b < 8; b++)
+        bitw_put(&w, (0x7e >> b) & 1);
+    while (w.nbit != 0) /* idle line */
+        bitw_put(&w, 1);
 
-        rate = (double)noise / nbits;
-        fact = rate > ber ? 3.5 : 6.0;
-        a = (int)((1.0 - pow(1.0 - ber, fact * blk->wptr)) * (RAND_MAX + 1.0) + 0.5);
-        if (rand() <= a) {
-            p = &blk->data[rand() % blk->wptr];
-            if (*p & 0x0f) {
-                *p ^= 1 << (rand() % 8);
-                noise++;
-                dbg_warning("Impose noise on received data, %u/%u=%.1E\n", noise, nbits, (double)noise / nbits);
+    return (int)(w.p - out);
+}
+
+static int hdlc_ones;           /* 1s in a row, not yet taken as data */
+static unsigned int hdlc_acc;   /* data bits of the byte being assembled */
+static int hdlc_nacc;
+
+static void hdlc_bit(int bit)
+{
+    unsigned char ch;
+
+    if (rf_buf == NULL)
+        return;
+    hdlc_acc |= bit << hdlc_nacc;
+    if (++hdlc_nacc == 8) {
+        ch = (unsigned char)hdlc_acc;
+        rf_buf->crc = crc32_update(rf_buf->crc, &ch, 1);
+        rf_put(ch);
+        hdlc_acc = hdlc_nacc = 0;
+    }
+}
+
+static void hdlc_byte(unsigned char ch)
+{
+    int b, k;
+
+    for (b = 0; b < 8; b++) {
+        if ((ch >> b) & 1) {
+            if (++hdlc_ones == 7 && rf_buf) { /* abort or idle line: drop the frame */
+                pool_put(&rf_pool, rf_buf);
+                rf_buf = NULL;
             }
+            continue;
+        }
+
+        if (hdlc_ones == 6) {
+            /* flag: the 0 before its 1s went in as a data bit, drop it */
+            rf_close();
+            rf_open();
+            hdlc_acc = hdlc_nacc = 0;
+        } else if (hdlc_ones < 7) {
+            for (k = 0; k < hdlc_ones; k++)
+                hdlc_bit(1);
+            if (hdlc_ones != 5) /* else a stuffed 0 */
+                hdlc_bit(0);
         }
+        hdlc_ones = 0;
     }
+}
 
-    blk->commit_ts = now + CHAN_DELAY - 10;
-    blk->link = NULL; 
+static void hdlc_decode(const unsigned char *p, int n)
+{
+    while (n-- > 0)
+        hdlc_byte(*p++);
+}
 
-    if (rblk_head == NULL) 
-        rblk_head = rblk_tail = blk;
-    else {
-        rblk_tail->link = blk;
-        rblk_tail = blk;
+static const struct CODEC codecs[] = {
+    { CODEC_NIBBLE, "nibble", 4, nibble_max_wire, nibble_encode, nibble_decode },
+    { CODEC_COBS,   "cobs",   8, cobs_max_wire,   cobs_encode,   cobs_decode },
+    { CODEC_HDLC,   "hdlc",   8, hdlc_max_wire,   hdlc_encode,   hdlc_decode },
+};
+
+#define NCODEC ((int)(sizeof(codecs) / sizeof(codecs[0])))
+
+static const struct CODEC *codec = &codecs[0];
+
+static int codec_id(const char *name)
+{
+    int i;
+
+    for (i = 0; i < NCODEC; i++) {
+        if (stricmp(name, codecs[i].name) == 0)
+            return codecs[i].id;
     }
+    return 0;
 }
 
-static unsigned char recv_byte(void)
+static int codec_max_wire(int len)
 {
-    unsigned char ch;
-    struct BLK *blk = rblk_head;
+    return codec->max_wire(len);
+}
 
-    if (blk == NULL || blk->commit_ts > now) 
-        ABORT("recv_byte(): Receiving Queue is empty");
+static int codec_encode(unsigned char *out, const unsigned char *frame, int len, unsigned int *crc)
+{
+    return codec->encode(out, frame, len, crc);
+}
 
-    ch = blk->data[blk->rptr++];
-    if (blk->rptr == blk->wptr) {
-        rblk_head = blk->link;
-        free(blk);
-    } 
-    
-    return ch;
+/* blocking exchange of the handshake bytes, never reads past them */
+static void link_xfer(unsigned char *buf, int len, int sending)
+{
+    int n;
+
+    while (len > 0) {
+        if (mode_shm) {
+            n = sending ? shm_sendv(&buf, &len, 1) : shm_recv(buf, len);
+            if (n < 0) {
+                shm_wait(sending, -1);
+                continue;
+            }
+        } else {
+            n = sending ? send(sock, (char *)buf, len, 0) : recv(sock, (char *)buf, len, 0);
+            if (n < 0 && sock_timeout())
+                continue;
+        }
+        if (n <= 0) {
+            lprintf("TCP disconnected.\n");
+            exit(0);
+        }
+        buf += n;
+        len -= n;
+    }
 }
 
-/* Timer Management */
+static void codec_use(int id);
 
-#define NTIMER 129
-static int timer[NTIMER];
-#define ACK_TIMER_ID (NTIMER - 1)
+/* B tells A which codec it wants, A settles on one and answers */
+static void codec_negotiate(void)
+{
+    unsigned char mine = (unsigned char)mode_codec, agreed;
 
-void start_timer(unsigned int nr, unsigned int ms)
+    if (station == 'b') {
+        link_xfer(&mine, 1, 1);
+        link_xfer(&agreed, 1, 0);
+        if (agreed == 0xff)
+            ABORT("Station A wants a different framing codec");
+    } else {
+        link_xfer(&agreed, 1, 0);
+        if (mine && agreed && mine != agreed) {
+            agreed = 0xff;
+            link_xfer(&agreed, 1, 1);
+            ABORT("Station B wants a different framing codec");
+        }
+        if (agreed == 0)
+            agreed = mine ? mine : CODEC_NIBBLE;
+        link_xfer(&agreed, 1, 1);
+    }
+
+    codec_use(agreed);
+}
+
+static void codec_use(int id)
 {
-    if (nr >= ACK_TIMER_ID) 
-        ABORT("start_timer(): timer No. must be 0~128");
-    timer[nr] = now + phl_sq_len() * 8000 / CHAN_BPS + ms;
+    int i;
+
+    for (i = 0; i < NCODEC; i++) {
+        if (codecs[i].id == id)
+            codec = &codecs[i];
+    }
+    wire_bits = codec->wire_bits;
+    if (codec->id == CODEC_NIBBLE) {
+        nk = nibble_pick();
+        lprintf("Framing codec: %s (%s kernels), %d bits per wire byte\n", codec->name, nk->name, wire_bits);
+    } else
+        lprintf("Framing codec: %s, %d bits per wire byte\n", codec->name, wire_bits);
 }
 
-void stop_timer(unsigned int nr)
+/* both stations must pace and delay by the same --bps, --delay and --schedule */
+static void chan_negotiate(void)
 {
-    if (nr < ACK_TIMER_ID) 
-        timer[nr] = 0;
+    unsigned int mine = crc32((unsigned char *)chan, chan_nstep * (int)sizeof(chan[0])), peer;
+
+    if (station == 'b') {
+        link_xfer((unsigned char *)&mine, sizeof(mine), 1);
+        link_xfer((unsigned char *)&peer, sizeof(peer), 0);
+    } else {
+        link_xfer((unsigned char *)&peer, sizeof(peer), 0);
+        link_xfer((unsigned char *)&mine, sizeof(mine), 1);
+    }
+    if (peer != mine)
+        ABORT("The other station runs a different channel (--bps, --delay or --schedule)");
 }
 
-int get_timer(unsigned int nr)
+/* 
+   chanemu handshake, keep in step with chanemu.c: the station says who it
+   is, which codec it wants and which pair it belongs to (-p); once the
+   peer is in too, the relay answers with the codec agreed on, the channel
+   and the epoch of both. The relay imposes the delay and the noise, the
+   station only paces what it sends at the rate it is told.
+*/
+#define RELAY_MAGIC 0x52454c59
+
+struct RELAY_HELLO {
+    unsigned int magic;
+    int station;
+    int codec;     /* 0: any */
+    int port;
+};
+
+struct RELAY_REPLY {
+    int codec;     /* -1: the stations want different codecs */
+    int bps[2];
+    int delay[2];  /* ms */
+    long long epoch;
+};
+
+static void relay_negotiate(void)
 {
-    if (nr >= ACK_TIMER_ID || timer[nr] == 0)
-        return 0;
-    return timer[nr] > now ? timer[nr] - now : 0;
+    struct RELAY_HELLO hello;
+    struct RELAY_REPLY reply;
+
+    hello.magic = RELAY_MAGIC;
+    hello.station = station;
+    hello.codec = mode_codec;
+    hello.port = port;
+    link_xfer((unsigned char *)&hello, sizeof(hello), 1);
+
+    lprintf("Waiting for the peer of pair %u at the relay ... ", port);
+    fflush(stdout);
+    link_xfer((unsigned char *)&reply, sizeof(reply), 0);
+    if (reply.codec < 0)
+        ABORT("The stations want different framing codecs");
+    lprintf("Done.\n");
+
+    epoch = reply.epoch;
+    ber = 0.0;
+    chan[0].bps[0] = reply.bps[0];
+    chan[0].bps[1] = reply.bps[1];
+    chan[0].delay[0] = reply.delay[0];
+    chan[0].delay[1] = reply.delay[1]; /* the receive blocks keep the size pool_init() gave them */
+    lprintf("Relay channel: A->B %d bps %d ms, B->A %d bps %d ms\n", 
+        chan[0].bps[0], chan[0].delay[0], chan[0].bps[1], chan[0].delay[1]);
+
+    codec_use(reply.codec);
 }
 
-void start_ack_timer(unsigned int ms)
+/* decode the first received block */
+static void rblk_commit(void)
 {
-    if (timer[ACK_TIMER_ID] == 0)
-        timer[ACK_TIMER_ID] = now + ms;
+    struct BLK *blk = rblk_head;
+    int n = blk->wptr - blk->rptr;
+
+    if (ts0 == 0) {
+        ts0 = now;
+        if (ts0 >= n * TB_BYTE / chan_bps(chan_in()))
+            ts0 -= n * TB_BYTE / chan_bps(chan_in());
+    }
+
+    codec->decode(blk->data + blk->rptr, n);
+    rblk_head = blk->link;
+    pool_put(&blk_pool, blk);
 }
 
-void stop_ack_timer(void)
+static void bond_commit(void);
+
+/* decode all received data whose propagation delay has elapsed */
+static void commit_blocks(void)
 {
-    timer[ACK_TIMER_ID] = 0;
+    if (mode_bond > 1) {
+        bond_commit();
+        return;
+    }
+
+    while (rblk_head != NULL && rblk_head->commit_ts <= now)
+        rblk_commit();
 }
 
-static int scan_timer(int *nr)
+/* 
+   Link aggregation (--bond=<n>[,<skew>])
+
+   <n> member channels between the stations, each with the bit rate, the
+   pacing and the noise of one channel and a delay <skew> ms longer than
+   the member before. A frame goes whole to the member with the fewest
+   bytes queued; each member is decoded on its own and the frames join
+   the one receiving queue as they are completed, so the protocol gets
+   them in the order they arrive, not in the order they were sent.
+
+   The members share the link: every piece of member data goes out behind
+   a 3-byte header (member, length), and the receiver splits the stream
+   up again before the noise and the delay. The physical layer keeps the
+   member it works on in its usual variables, bond_use() swaps them.
+*/
+
+struct MEMBER {
+    struct SQ_FRAME *sq_head, *sq_tail;
+    int sq_bytes;
+    long long tb_credit, tb_ts;
+    long long aqm_first_above, aqm_drop_next;
+    int aqm_dropping, aqm_count, aqm_last_count;
+    struct BLK *rblk_head, *rblk_tail;
+    struct RCV_FRAME *rf_buf;
+    int hdlc_ones, hdlc_nacc;
+    unsigned int hdlc_acc;
+    int frames; /* frames sent over the member */
+};
+
+static struct MEMBER bond[MAX_BOND];
+static int bond_next;
+
+static unsigned char *bond_out;       /* headers and member data not written yet */
+static int bond_out_size, bond_out_len, bond_out_pos;
+
+static unsigned char bond_hdr[3];     /* receiving: header being read */
+static int bond_nhdr, bond_member, bond_left;
+
+static void bond_use(int m)
 {
-    int i;
+    struct MEMBER *b = &bond[bond_cur];
+
+    if (m == bond_cur)
+        return;
+
+    b->sq_head = sq_head;
+    b->sq_tail = sq_tail;
+    b->sq_bytes = sq_bytes;
+    b->tb_credit = tb_credit;
+    b->tb_ts = tb_ts;
+    b->aqm_first_above = aqm_first_above;
+    b->aqm_drop_next = aqm_drop_next;
+    b->aqm_dropping = aqm_dropping;
+    b->aqm_count = aqm_count;
+    b->aqm_last_count = aqm_last_count;
+    b->rblk_head = rblk_head;
+    b->rblk_tail = rblk_tail;
+    b->rf_buf = rf_buf;
+    b->hdlc_ones = hdlc_ones;
+    b->hdlc_nacc = hdlc_nacc;
+    b->hdlc_acc = hdlc_acc;
+
+    b = &bond[m];
+    sq_head = b->sq_head;
+    sq_tail = b->sq_tail;
+    sq_bytes = b->sq_bytes;
+    tb_credit = b->tb_credit;
+    tb_ts = b->tb_ts;
+    aqm_first_above = b->aqm_first_above;
+    aqm_drop_next = b->aqm_drop_next;
+    aqm_dropping = b->aqm_dropping;
+    aqm_count = b->aqm_count;
+    aqm_last_count = b->aqm_last_count;
+    rblk_head = b->rblk_head;
+    rblk_tail = b->rblk_tail;
+    rf_buf = b->rf_buf;
+    hdlc_ones = b->hdlc_ones;
+    hdlc_nacc = b->hdlc_nacc;
+    hdlc_acc = b->hdlc_acc;
+
+    bond_cur = m;
+}
+
+/* both stations must split the link the same way */
+static void bond_negotiate(void)
+{
+    unsigned char mine = (unsigned char)mode_bond, peer;
 
-    for (i = 0; i < NTIMER; i++) {
-        if (timer[i] && timer[i] <= now) {
-            *nr = i;
-            timer[i] = 0;
-            return i == ACK_TIMER_ID ? ACK_TIMEOUT : DATA_TIMEOUT;
+    if (station == 'b') {
+        link_xfer(&mine, 1, 1);
+        link_xfer(&peer, 1, 0);
+    } else {
+        link_xfer(&peer, 1, 0);
+        link_xfer(&mine, 1, 1);
+    }
+    if (peer != mine)
+        ABORT("The other station bonds a different number of channels");
+}
+
+/* the member a new frame goes to: fewest bytes queued, ties taken in turn */
+static void bond_pick(void)
+{
+    int i, m, best = 0, depth, least = 0;
+
+    for (i = 0; i < mode_bond; i++) {
+        m = (bond_next + i) % mode_bond;
+        depth = m == bond_cur ? sq_bytes : bond[m].sq_bytes;
+        if (i == 0 || depth < least) {
+            best = m;
+            least = depth;
+        }
+    }
+    bond_next = (best + 1) % mode_bond;
+    bond_use(best);
+    bond[best].frames++;
+}
+
+/* wire bytes queued over all members and not written yet */
+static int sq_total(void)
+{
+    int m, n;
+
+    if (mode_bond == 1)
+        return sq_len();
+
+    n = bond_out_len - bond_out_pos;
+    for (m = 0; m < mode_bond; m++)
+        n += m == bond_cur ? sq_bytes : bond[m].sq_bytes;
+    return n;
+}
+
+/* sq_send() of the member in use: its pieces go behind headers into bond_out */
+static int bond_write(unsigned char **buf, int *len, int cnt)
+{
+    int i, n = 0;
+
+    for (i = 0; i < cnt; i++) {
+        if (bond_out_len + 3 + len[i] > bond_out_size) {
+            bond_out_size = bond_out_len + 3 + len[i] + 4096;
+            if ((bond_out = (unsigned char *)realloc(bond_out, bond_out_size)) == NULL)
+                ABORT("No enough memory");
         }
+        bond_out[bond_out_len++] = (unsigned char)bond_cur;
+        bond_out[bond_out_len++] = (unsigned char)len[i];
+        bond_out[bond_out_len++] = (unsigned char)(len[i] >> 8);
+        memcpy(bond_out + bond_out_len, buf[i], len[i]);
+        bond_out_len += len[i];
+        n += len[i];
+    }
+    return n;
+}
+
+static void bond_flush(void)
+{
+    unsigned char *p = bond_out + bond_out_pos;
+    int n = bond_out_len - bond_out_pos;
+
+    if (n == 0)
+        return;
+    bond_out_pos += send_sq_data(&p, &n, 1);
+    if (bond_out_pos == bond_out_len)
+        bond_out_pos = bond_out_len = 0;
+}
+
+static void bond_send(void)
+{
+    int m;
+
+    /* members only take more once the link has taken what they gave */
+    bond_flush();
+    if (bond_out_len)
+        return;
+
+    for (m = 0; m < mode_bond; m++) {
+        bond_use(m);
+        sq_send();
+    }
+    bond_flush();
+}
+
+static long long bond_pace_deadline(void)
+{
+    long long t, deadline = 0;
+    int m;
+
+    for (m = 0; m < mode_bond; m++) {
+        bond_use(m);
+        t = sq_pace_deadline();
+        if (t && (deadline == 0 || t < deadline))
+            deadline = t;
     }
-    return 0;
+    return deadline;
 }
 
-/* Network Layer Functions */
+/* split a received block up by member */
+static void bond_demux(struct BLK *blk, long long ts)
+{
+    unsigned char *p = blk->data + blk->rptr;
+    int n = blk->wptr - blk->rptr, k;
+    struct BLK *seg;
+
+    while (n > 0) {
+        if (bond_left == 0) {
+            bond_hdr[bond_nhdr++] = *p++;
+            n--;
+            if (bond_nhdr == 3) {
+                bond_nhdr = 0;
+                bond_member = bond_hdr[0];
+                bond_left = bond_hdr[1] | bond_hdr[2] << 8;
+                if (bond_member >= mode_bond || bond_left == 0)
+                    ABORT("Bonded link out of step");
+            }
+            continue;
+        }
 
-static int network_layer_active = 0;
-static int rpackets, rbytes;
+        k = n < bond_left ? n : bond_left;
+        seg = (struct BLK *)pool_get(&blk_pool);
+        seg->rptr = 0;
+        seg->wptr = k;
+        memcpy(seg->data, p, k);
+        bond_use(bond_member);
+        rblk_queue(seg, ts);
+        p += k;
+        n -= k;
+        bond_left -= k;
+    }
+    pool_put(&blk_pool, blk);
+}
 
-void enable_network_layer(void)
+/* earliest commit time of a received block, 0 if none */
+static long long rblk_deadline(void)
 {
-    network_layer_active = 1;
+    long long t = 0;
+    int m;
+
+    for (m = 0; m < mode_bond; m++) {
+        bond_use(m);
+        if (rblk_head && (t == 0 || rblk_head->commit_ts < t))
+            t = rblk_head->commit_ts;
+    }
+    return t;
 }
 
-void disable_network_layer(void)
+/* commit the members' blocks in the order their delays elapse */
+static void bond_commit(void)
 {
-    network_layer_active = 0;
+    long long t = 0;
+    int m, first;
+
+    for (;;) {
+        first = -1;
+        for (m = 0; m < mode_bond; m++) {
+            bond_use(m);
+            if (rblk_head && rblk_head->commit_ts <= now && (first < 0 || rblk_head->commit_ts < t)) {
+                first = m;
+                t = rblk_head->commit_ts;
+            }
+        }
+        if (first < 0)
+            return;
+        bond_use(first);
+        rblk_commit();
+    }
 }
 
-static int network_layer_ready(void)
+static void bond_dump(void)
 {
-    static int last_ts = 0;
+    int m;
 
-    if (!network_layer_active)
-        return 0;
+    if (mode_bond == 1 || bond[0].frames == 0)
+        return;
 
-    if (mode_flood) 
-        return 1;
+    lprintf("Bonded link: frames sent per channel");
+    for (m = 0; m < mode_bond; m++)
+        lprintf(" %d", bond[m].frames);
+    lprintf("\n");
+}
 
-    if ((now - last_ts) * CHAN_BPS / 8 / 1000 < PKT_LEN * 3 / 4)
-        return 0;
+/* 
+   Pipelined physical layer (--threads)
+
+   An I/O thread owns the socket, the sending queue and its pacing, the
+   received blocks with their noise and delay, and the decoders with the
+   CRC. The protocol thread keeps the timers, the network layer and the
+   events. Frames go between the two over single-producer single-consumer
+   rings:
+       io_tx:   encoded frames, protocol to I/O thread
+       io_rx:   received frames and their CRC, I/O to protocol thread
+       io_free: received frames done with, back to the I/O thread's pool
+   An eventfd gets the I/O thread out of poll(), a futex word the protocol
+   thread out of io_wait(); like the shm doorbells, the wakeup call is only
+   made while the other side is asleep.
+*/
+
+#ifdef __linux__
+
+#define IO_RING_SIZE 4096 /* power of 2 */
+#define IO_SPIN 50         /* us each thread polls the other before going to sleep */
+
+struct IO_RING {
+    volatile unsigned int head;   /* written by the consumer only */
+    char pad0[60];
+    volatile unsigned int tail;   /* written by the producer only */
+    char pad1[60];
+    void *slot[IO_RING_SIZE];
+};
 
-    if (station == 'b') {
-        if (now / 1000 / mode_cycle % 2 != mode_ibib) {
-            if (now - last_ts < 4000 + rand() % 500)
-                return 0;
-        }
-        if (now < CHAN_DELAY + 3 * PKT_LEN * 8000 / CHAN_BPS)
-            return 0;
-    }
+static struct IO_RING io_tx, io_rx, io_free;
+static struct RCV_FRAME *io_rx_head, *io_rx_tail; /* received frames io_rx had no room for */
+static int io_efd, io_delivered, io_spin;
+static volatile int io_sleeping, io_bell, io_proto_sleeping, io_quit;
+static pthread_t io_tid;
+static int io_running;
 
-    last_ts = now;
+static int ring_put(struct IO_RING *r, void *p)
+{
+    unsigned int tail = r->tail;
 
+    if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == IO_RING_SIZE)
+        return 0;
+    r->slot[tail & (IO_RING_SIZE - 1)] = p;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
     return 1;
 }
 
-static int randA(void)
+static void *ring_get(struct IO_RING *r)
 {
-    static unsigned int holdrand = 0x65109bc4;
-    return ((holdrand = holdrand * 214013L + 2531011L) >> 16) & 0x7fff;
+    unsigned int head = r->head;
+    void *p;
+
+    if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    p = r->slot[head & (IO_RING_SIZE - 1)];
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return p;
 }
 
-static int randB(void)
+static int ring_empty(struct IO_RING *r)
 {
-    static unsigned int holdrand = 0x1e459090;
-    return ((holdrand = holdrand * 214013L + 2531011L) >> 16) & 0x7fff;
+    return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
 }
 
-#define next_char() ((unsigned char)(my_rand() & 0xff))
+/* protocol thread: get the I/O thread out of poll() */
+static void io_kick(void)
+{
+    unsigned long long one = 1;
 
-static int layer3_ready = 0;
+    __sync_synchronize();
+    if (io_sleeping)
+        SYSCALL(write(io_efd, &one, sizeof(one)));
+}
 
-int get_packet(unsigned char *packet)
+/* I/O thread: get the protocol thread out of io_wait() */
+static void io_ring_bell(void)
 {
-    static int pkt_no = 0;
-    int i, len;
-    int (*my_rand)(void) = station == 'a' ? randA : randB;
-
-    if (!layer3_ready)
-        ABORT("get_packet(): Network layer is not ready for a new packet");
-    
-    len = PKT_LEN;
-    for (i = 2; i < len; i++)
-        packet[i] = next_char();
-    *(unsigned short *)packet = (station - 'a' + 1) * 10000 + (pkt_no++ % 10000);
+    __sync_fetch_and_add(&io_bell, 1);
+    __sync_synchronize();
+    if (io_proto_sleeping)
+        SYSCALL(syscall(SYS_futex, &io_bell, FUTEX_WAKE, 1, NULL, NULL, 0));
+}
 
-    layer3_ready = 0;
+/* protocol thread: end the run once the I/O thread has lost the link */
+static void io_check(void)
+{
+    /* frames not collected yet are lost, as when the socket closes without --threads */
+    if (io_down) {
+        lprintf("TCP disconnected.\n");
+        exit(0);
+    }
+}
 
-    return len;
+/* protocol thread: into a ring the I/O thread empties, waiting for room */
+static void io_put(struct IO_RING *r, void *p)
+{
+    while (!ring_put(r, p)) {
+        io_check();
+        io_kick();
+        sched_yield();
+    }
 }
 
-static int ts0;
+static void io_send(void *f)
+{
+    io_put(&io_tx, f);
+    io_kick();
+}
 
-void put_packet(unsigned char *packet, int len)
+static void io_release(void *f)
 {
-    static int last_ts = 0;
-    int i, (*my_rand)(void) = station == 'a' ? randB : randA;
+    io_put(&io_free, f);
+}
 
-    if (len != PKT_LEN) 
-        ABORT("Bad Packet length");
+/* I/O thread: a frame out of rf_close() */
+static void io_deliver(void *f)
+{
+    struct RCV_FRAME *rf = (struct RCV_FRAME *)f;
 
-    for (i = 2; i < PKT_LEN; i++) {
-        if (packet[i] != next_char()) 
-            ABORT("Network Layer received a bad packet from data link layer");
-    }
-    rpackets++;
-    rbytes += len;
+    io_delivered++;
+    if (io_rx_head == NULL && ring_put(&io_rx, rf))
+        return;
 
-    if (now - last_ts > 2000 && now > ts0 + 2000) {
-        double bps;
-        bps = (double)rbytes * 8 * 1000 / (now - ts0);
-        lprintf(".... %d packets received, %.0f bps, %.2f%%, Err %d (%.1e)\n", 
-            rpackets, bps, bps / CHAN_BPS * 100, noise, (double)noise/nbits);
-        last_ts = now;
+    rf->link = NULL;
+    if (io_rx_head == NULL)
+        io_rx_head = io_rx_tail = rf;
+    else {
+        io_rx_tail->link = rf;
+        io_rx_tail = rf;
     }
 }
 
-#define DBG_EVENT    0x01
-#define DBG_FRAME    0x02
-#define DBG_WARNING  0x04
-
-void dbg_event(char *fmt, ...)
+static void io_flush_rx(void)
 {
-	va_list arg_ptr;
+    struct RCV_FRAME *next;
 
-	if (debug_mask & DBG_FRAME) {
-		va_start(arg_ptr, fmt);
-		__v_lprintf(fmt, arg_ptr);
-		va_end(arg_ptr);
-	}
+    while (io_rx_head) {
+        next = io_rx_head->link;
+        if (!ring_put(&io_rx, io_rx_head))
+            break;
+        io_rx_head = next;
+    }
 }
 
-void dbg_frame(char *fmt, ...)
+/* protocol thread: received frames into the receiving queue */
+static void io_collect(void)
 {
-	va_list arg_ptr;
-
-	if (debug_mask & DBG_FRAME) {
-		va_start(arg_ptr, fmt);
-		__v_lprintf(fmt, arg_ptr);
-		va_end(arg_ptr);
-	}
+    struct RCV_FRAME *rf;
+
+    while ((rf = (struct RCV_FRAME *)ring_get(&io_rx)) != NULL) {
+        rf->link = NULL;
+        if (rf_head == NULL)
+            rf_head = rf_tail = rf;
+        else {
+            rf_tail->link = rf;
+            rf_tail = rf;
+        }
+        rf_count++;
+    }
+    io_check();
 }
 
-void dbg_warning(char *fmt, ...)
+/* protocol thread: sleep until 'deadline' or a frame or room in the sending queue */
+static int io_wait(long long deadline)
 {
-	va_list arg_ptr;
-
-	if (debug_mask & DBG_WARNING) {
-		va_start(arg_ptr, fmt);
-		__v_lprintf(fmt, arg_ptr);
-		va_end(arg_ptr);
-	}
-}
+    struct timespec ts;
+    long long us = deadline - get_us(), t;
+    int seq, ret = 1;
 
-/* Event Generator */
+    if (us <= 0)
+        return 0;
 
-#define PHL_SQ_LEVEL  50 
+    /* the I/O thread usually answers within microseconds, a futex round trip costs more */
+    t = get_us() + (us < io_spin ? us : io_spin);
+    while (ring_empty(&io_rx) && !(inform_phl_ready && phl_sq_len() < PHL_SQ_LEVEL)) {
+        if (get_us() >= t)
+            break;
+    }
 
-static int sleep_cnt, start_ms, wakeup_ms, busy_cnt;
-static int bias_cnt;
+    seq = io_bell;
+    io_proto_sleeping = 1;
+    __sync_synchronize();
 
-struct RCV_FRAME {
-    int len;
-    int state;
-    unsigned char frame[2048];
-    struct RCV_FRAME *link;
-};
+    if (ring_empty(&io_rx) && !(inform_phl_ready && phl_sq_len() < PHL_SQ_LEVEL)) {
+        ts.tv_sec = (time_t)(us / 1000000);
+        ts.tv_nsec = (long)(us % 1000000 * 1000);
+        if (SYSCALL(syscall(SYS_futex, &io_bell, FUTEX_WAIT, seq, &ts, NULL, 0)) < 0 && errno == ETIMEDOUT)
+            ret = 0;
+    }
 
-static struct RCV_FRAME *rf_head, *rf_tail, *rf_buf;
+    io_proto_sleeping = 0;
+    return ret;
+}
 
-int recv_frame(unsigned char *buf, int size)
+static void *io_main(void *arg)
 {
-    int len;
-    struct RCV_FRAME *next;
-    char msg[256];
+    struct pollfd pfd[2];
+    struct timespec ts;
+    struct SQ_FRAME *f;
+    void *rf;
+    long long deadline, t;
+    unsigned long long cnt;
+    int full;
+
+    if (mode_cpu >= 0)
+        pin_cpu(mode_cpu + 1);
+
+    while (!io_quit) {
+        now = get_us();
+
+        while ((rf = ring_get(&io_free)) != NULL)
+            pool_put(&rf_pool, rf);
+        while ((f = (struct SQ_FRAME *)ring_get(&io_tx)) != NULL)
+            sq_append(f);
+
+        commit_blocks();
+        io_flush_rx();
+        if (io_delivered) {
+            io_delivered = 0;
+            io_ring_bell();
+        }
 
-    if (rf_head == NULL) 
-        ABORT("recv_frame(): Receiving Queue is empty");
+        /* sleep until the socket can take what the pacing allows, data, a commit or a kick */
+        t = pace_deadline();
+        pfd[0].fd = sock;
+        pfd[0].events = POLLIN | (sq_head && t <= now ? POLLOUT : 0);
+        pfd[1].fd = io_efd;
+        pfd[1].events = POLLIN;
+
+        deadline = now + 1000000;
+        if (t > now && t < deadline)
+            deadline = t;
+        if (rblk_head && rblk_head->commit_ts < deadline)
+            deadline = rblk_head->commit_ts;
+        if (io_rx_head && now + 1000 < deadline) /* io_rx full, try again soon */
+            deadline = now + 1000;
+
+        /* spin a little for the protocol thread's next frame unless there is socket work */
+        if (!(pfd[0].events & POLLOUT)) {
+            t = now + io_spin < deadline ? now + io_spin : deadline;
+            while (ring_empty(&io_tx) && get_us() < t)
+                ;
+        }
 
-    len = rf_head->len;
+        io_sleeping = 1;
+        __sync_synchronize();
+        if (!ring_empty(&io_tx) || deadline < now || io_quit)
+            deadline = now;
+        ts.tv_sec = (time_t)((deadline - now) / 1000000);
+        ts.tv_nsec = (long)((deadline - now) % 1000000 * 1000);
+        if (SYSCALL(ppoll(pfd, 2, &ts, NULL)) < 0 && errno != EINTR)
+            ABORT("system ppoll()");
+        io_sleeping = 0;
+
+        now = get_us();
+        if (pfd[1].revents & POLLIN)
+            SYSCALL(read(io_efd, &cnt, sizeof(cnt)));
+        if (pfd[0].revents & POLLOUT) {
+            full = sq_len() >= PHL_SQ_LEVEL;
+            socket_send();
+            if (full && sq_len() < PHL_SQ_LEVEL)
+                io_ring_bell();
+        }
+        if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR))
+            socket_recv();
 
-    if (size < len) { 
-        sprintf(msg, "recv_frame(): %d-byte buffer is too small to save %d-byte received frame", size, len);
-        ABORT(msg);
+        io_nsyscalls = nsyscalls;
+        if (io_down) {
+            io_ring_bell();
+            break;
+        }
     }
-    
-    memcpy(buf, rf_head->frame, len);
 
-    next = rf_head->link;
-    if (next == NULL) 
-        rf_tail = NULL;
-    free(rf_head); 
-    rf_head = next;
+    return arg;
+}
 
-    return len;
+static void io_start(void)
+{
+    if ((io_efd = eventfd(0, EFD_NONBLOCK)) < 0)
+        ABORT("system eventfd()");
+    /* spinning only pays when the two threads really run side by side */
+    io_spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? IO_SPIN : 0;
+    if (pthread_create(&io_tid, NULL, io_main, NULL) != 0)
+        ABORT("pthread_create(): no I/O thread");
+    io_running = 1;
 }
 
-int wait_for_event(int *arg)
+/* exit hook: stop the I/O thread before the dumps read what it owns */
+static void io_stop(void)
 {
-    fd_set rfd, wfd;
-    struct timeval tm;
-    int event, n, i;
-    unsigned char ch;
+    unsigned long long one = 1;
 
-    for (;;) {
+    /* not when the I/O thread itself ABORTs */
+    if (!io_running || pthread_equal(pthread_self(), io_tid))
+        return;
+    io_running = 0;
+    io_quit = 1;
+    SYSCALL(write(io_efd, &one, sizeof(one)));
+    pthread_join(io_tid, NULL);
+}
 
-        now = get_ms();
-     
-        /* commit received socket data */
-        if (rblk_head && rblk_head->commit_ts <= now) {
-            n = rblk_head->wptr - rblk_head->rptr;
-            
-            if (ts0 == 0) {
-                ts0 = now;
-                if (ts0 >= n / 2)
-                    ts0 -= n / 2;
-            }
+#else
 
-            for (i = 0; i < n; i++) {
-                ch = recv_byte();
-                if (ch == 0xff) {
-                    if (rf_buf == NULL) 
-                        rf_buf = (struct RCV_FRAME *)calloc(1, sizeof(struct RCV_FRAME));
-                    else {
-                        if (rf_buf->len > 0) {
-                            if (rf_head == NULL) 
-                                rf_head = rf_tail = rf_buf;
-                            else {
-                                rf_tail->link = rf_buf;
-                                rf_tail = rf_buf;
-                            }
-                            rf_buf = NULL;
-                        }
-                    }
-                } else if (rf_buf && rf_buf->len < sizeof(rf_buf->frame)) {
-                    if (rf_buf->state == 0) {
-                        rf_buf->frame[rf_buf->len] = ch;
-                        rf_buf->state = 1;
-                    } else {
-                        rf_buf->frame[rf_buf->len] |= (ch << 4) ^ (ch & 0xf0);
-                        rf_buf->len++;
-                        rf_buf->state = 0;
-                    }
-                }
-            }
+static void io_start(void) {}
+static void io_stop(void) {}
+static void io_send(void *f) {}
+static void io_release(void *f) {}
+static void io_deliver(void *f) {}
+static void io_collect(void) {}
+static int  io_wait(long long deadline) { return 0; }
 
-            if (rf_head)
-                return FRAME_RECEIVED;
-        }
-        
+#endif
+
+#define add_event(t, a) do { evs[n].type = (t); evs[n].arg = (a); n++; } while (0)
+
+/* 
+   Collect up to 'max' ready events without sleeping. Events come out in 
+   the order wait_for_event() has always prioritized them: received frames,
+   network layer, timers (earliest deadline first), physical layer. 
+*/
+static int poll_events(struct event *evs, int max)
+{
+    fd_set rfd, wfd;
+    struct timeval tm;
+    int n = 0, event, arg, nframes;
+
+    now = get_us();
+
+    /* commit received socket data */
+    if (mode_threads)
+        io_collect();
+    else
+        commit_blocks();
+    while (n < max && rf_announced < rf_count) {
+        add_event(FRAME_RECEIVED, 0);
+        rf_announced++;
+    }
+    nframes = n;
+    if (n == max)
+        return n;
+    
+    if (mode_sim) {
+        /* peer records are only read by sim_advance() to keep runs reproducible */
+        socket_send();
+    } else if (mode_threads) {
+        /* the I/O thread moves the bytes */
+    } else if (mode_shm) {
+        socket_send();
+        if (shm_readable())
+            socket_recv();
+    } else if (mode_uring) {
+        ur_reap();
+        socket_send();
+    } else {
         /* test socket send/receive */
         tm.tv_sec = tm.tv_usec = 0;
         FD_ZERO(&rfd);
@@ -823,7 +4718,7 @@ int wait_for_event(int *arg)
         FD_SET(sock, &rfd);
         FD_SET(sock, &wfd);
 
-        if (select(sock + 1, &rfd, &wfd, 0, &tm) < 0) 
+        if (SYSCALL(select(sock + 1, &rfd, &wfd, 0, &tm)) < 0) 
             ABORT("system select()");
 
         /* socket send */
@@ -833,67 +4728,258 @@ int wait_for_event(int *arg)
         /* socket receive */
         if (FD_ISSET(sock, &rfd)) 
             socket_recv();
+    }
 
-        /* network layer event */
-        if (network_layer_ready()) {
-            layer3_ready = 1;
-            return NETWORK_LAYER_READY;
-        }
+    /* network layer event */
+    if (network_layer_ready()) {
+        layer3_ready = 1;
+        add_event(NETWORK_LAYER_READY, 0);
+    }
+
+    /* 
+       At most one timeout, and none next to received frames: the protocol
+       may stop or restart timers handling the frames or a timeout earlier
+       in the batch, and a timeout handed over can no longer be cancelled. 
+       The next one goes with the next call.
+    */
+    if (n < max && nframes == 0 && (event = scan_timer(&arg)) != 0)
+        add_event(event, arg);
+
+    /* physical layer event */
+    if (n < max && inform_phl_ready && phl_sq_len() < PHL_SQ_LEVEL * mode_bond) {
+        inform_phl_ready = 0;
+        add_event(PHYSICAL_LAYER_READY, 0);
+    }
+
+    /* sends queued for io_uring go with the next wait, unless there is none */
+    if (mode_uring && (n > 0 || !mode_wait))
+        ur_flush();
+
+    return n;
+}
+
+#undef add_event
+
+int wait_for_events(struct event *evs, int max)
+{
+    int n;
+
+    if (max <= 0)
+        ABORT("wait_for_events(): no room for events");
 
-        /* check all timers */
-        if ((event = scan_timer(arg)) != 0)
-            return event;
+    if (replay_file)
+        return replay_events(evs, max);
 
-        /* physical layer event */
-        if (inform_phl_ready && phl_sq_len()  < PHL_SQ_LEVEL) {
-            inform_phl_ready = 0;
-            return PHYSICAL_LAYER_READY;
+    for (;;) {
+
+        if ((n = poll_events(evs, max)) > 0) {
+            if (record_file)
+                record_events(evs, n);
+            return n;
         }
 
-        /* delay 'mode_tick' ms */
-        if (1) {
-            int ms0, t;
+        /* sleep until the next deadline or socket data */
+        if (mode_sim) {
+            magic_check();
+            sim_advance(next_deadline());
+        } else if (mode_wait) {
+            long long deadline, t;
+
+            magic_check();
+            deadline = next_deadline();
+            /* in --precise mode wake up early and spin the last stretch */
+            if (deadline > get_us() && wait_deadline(deadline - mode_spin) == 0) {
+                while ((t = get_us()) < deadline)
+                    ;
+                lateness_record(t - deadline);
+            }
+        } else { /* delay 'mode_tick' ms */
+            long long us0, t;
             static time_t last_warn;
-            ms0 = get_ms();
+            us0 = get_us();
             magic_check();
-            Sleep(mode_tick);
-            t = get_ms() - ms0;
+            SYSCALL(Sleep(mode_tick));
+            t = (get_us() - us0) / 1000;
+            lateness_record(get_us() - us0 - mode_tick * 1000LL);
             if (t > mode_tick + 50 && time(0) > last_warn + 1) {
                 lprintf("** WARNING: System too busy, sleep %d ms, but be awakened %d ms later\n", 
-                    mode_tick, t);
+                    mode_tick, (int)t);
                 last_warn = time(0);
             }
-        } else {
-            int ticks, ms;
-
-            sleep_cnt++;
-
-            ms = get_ms();
-            if (start_ms == 0)
-                start_ms = ms;
-            else if (ms - wakeup_ms > 1) {
-                ticks = (ms - start_ms) / mode_tick;
-                lprintf("====== CPU BUSY for %d ms (cnt %d)\n", ms - wakeup_ms, ++busy_cnt);
-                lprintf("------ noSleep %d, sleep %d, Elapse %d ticks\n", ticks - sleep_cnt, sleep_cnt, ticks);
-            }
-
-            magic_check();
-            ms = get_ms();
-            Sleep(mode_tick);
-            wakeup_ms = get_ms();
-
-            ms = wakeup_ms - ms;
-            if (ms > mode_tick + 1 || ms < mode_tick - 1) 
-                lprintf("++++++ Sleep(%d)=%d+%d (cnt %d)\n", mode_tick, mode_tick, ms - mode_tick, ++bias_cnt);
         }
 
         if (now > mode_life) {
             lprintf("Quit.\n");
+            if (mode_sim)
+                sim_quit();
             exit(0);
         }
     }
 }
 
+int wait_for_event(int *arg)
+{
+    struct event ev;
+
+    wait_for_events(&ev, 1);
+    *arg = ev.arg;
+
+    return ev.type;
+}
+
+
+/* 
+   Event Recording and Replay 
+
+   The record file holds everything the protocol gets from this library, in
+   call order, as compact records (numbers are LEB128 varints):
+       'B' <time delta us> <n> n * (<event> <arg>)    wait_for_event(s) batch
+       'F' <len> <bytes>                               recv_frame()
+       'P' <len> <bytes>                               get_packet()
+       'C' 1 <0|1>                                     cancel_frame(), replace_frame()
+   Replaying feeds them back as fast as possible to the unchanged protocol.
+*/
+
+#define RECORD_MAGIC "DLREC1"
+
+static long long rec_ts;
+static unsigned int rep_events, rep_frames, rep_packets;
+static clock_t rep_clock;
+
+static void put_varint(unsigned long long v)
+{
+    while (v >= 0x80) {
+        putc((int)(v & 0x7f) | 0x80, record_file);
+        v >>= 7;
+    }
+    putc((int)v, record_file);
+}
+
+static unsigned long long get_varint(void)
+{
+    unsigned long long v = 0;
+    int ch, shift = 0;
+
+    do {
+        if ((ch = getc(replay_file)) == EOF)
+            ABORT("Truncated replay file");
+        v |= (unsigned long long)(ch & 0x7f) << shift;
+        shift += 7;
+    } while (ch & 0x80);
+
+    return v;
+}
+
+static void record_open(void)
+{
+    fwrite(RECORD_MAGIC, 1, strlen(RECORD_MAGIC), record_file);
+    putc(station, record_file);
+}
+
+static void record_close(void)
+{
+    if (record_file) {
+        fclose(record_file);
+        record_file = NULL;
+    }
+}
+
+static void record_events(struct event *evs, int n)
+{
+    int i;
+
+    putc('B', record_file);
+    put_varint(now > rec_ts ? now - rec_ts : 0);
+    put_varint(n);
+    for (i = 0; i < n; i++) {
+        put_varint(evs[i].type);
+        put_varint(evs[i].arg);
+    }
+    if (now > rec_ts)
+        rec_ts = now;
+}
+
+static void record_data(int tag, unsigned char *buf, int len)
+{
+    putc(tag, record_file);
+    put_varint(len);
+    fwrite(buf, 1, len, record_file);
+}
+
+static void replay_open(void)
+{
+    char magic[sizeof(RECORD_MAGIC)];
+
+    if (fread(magic, 1, strlen(RECORD_MAGIC), replay_file) != strlen(RECORD_MAGIC) 
+        || memcmp(magic, RECORD_MAGIC, strlen(RECORD_MAGIC)) != 0)
+        ABORT("Not a record file");
+    if (getc(replay_file) != station)
+        ABORT("Record file was made by the other station");
+
+    lprintf("Replaying recorded run ...\n");
+    rep_clock = clock();
+}
+
+static void replay_done(void)
+{
+    double cpu = (double)(clock() - rep_clock) / CLOCKS_PER_SEC;
+
+    lprintf("Replay done: %u events, %u frames, %u packets, %.3f s CPU", 
+        rep_events, rep_frames, rep_packets, cpu);
+    if (rep_events)
+        lprintf(", %.2f us/event", cpu * 1000000 / rep_events);
+    lprintf("\n");
+    exit(0);
+}
+
+static int replay_events(struct event *evs, int max)
+{
+    int i, n, tag;
+
+    if ((tag = getc(replay_file)) == EOF)
+        replay_done();
+    if (tag != 'B')
+        ABORT("Replay out of step: protocol waits for events, record holds data");
+
+    now += get_varint();
+    if (ts0 == 0)
+        ts0 = now; /* the channel itself is not replayed */
+    n = (int)get_varint();
+    if (n > max)
+        ABORT("Replay out of step: recorded batch exceeds the event buffer");
+
+    for (i = 0; i < n; i++) {
+        evs[i].type = (int)get_varint();
+        evs[i].arg = (int)get_varint();
+        if (evs[i].type == NETWORK_LAYER_READY)
+            layer3_ready = 1;
+    }
+    rep_events += n;
+
+    return n;
+}
+
+static int replay_data(int tag, unsigned char *buf, int size)
+{
+    int len;
+
+    if (getc(replay_file) != tag)
+        ABORT("Replay out of step: record does not match the protocol's call");
+
+    len = (int)get_varint();
+    if (len > size)
+        ABORT("Replay: buffer too small for the recorded data");
+    if (fread(buf, 1, len, replay_file) != (size_t)len)
+        ABORT("Truncated replay file");
+
+    if (tag == 'F')
+        rep_frames++;
+    else if (tag == 'P')
+        rep_packets++;
+
+    return len;
+}
+
 
 /* Memory Protection */
 static unsigned int foot_magic[NMAGIC];
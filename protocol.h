@@ -1,4 +1,5 @@
 #ifndef __PROTOCOL_fr12hn_H__
+#define __PROTOCOL_fr12hn_H__
 
 #ifdef  __cplusplus
 extern "C" {
@@ -21,6 +22,21 @@ extern void protocol_init(int argc, char **argv);
 /* Event Driver */
 extern int wait_for_event(int *arg);
 
+/* 
+   Batched event driver: returns every ready event (at most 'max') at once.
+   A batch holds at most one DATA_TIMEOUT or ACK_TIMEOUT and never together
+   with FRAME_RECEIVED, so a timer stopped while handling the batch has not
+   fired in it.
+*/
+struct event {
+    int type;
+    int arg;
+};
+
+#define MAX_EVENTS 32
+
+extern int wait_for_events(struct event *evs, int max);
+
 #define NETWORK_LAYER_READY  0
 #define PHYSICAL_LAYER_READY 1
 #define FRAME_RECEIVED       2
@@ -35,17 +51,47 @@ extern void disable_network_layer(void);
 extern int  get_packet(unsigned char *packet);
 extern void put_packet(unsigned char *packet, int len);
 
-/* Physical Layer functions */
+/* 
+   Physical Layer functions. A received frame longer than MAX_FRAME_LEN
+   (a packet plus header and CRC bytes) can only be frames run together by
+   a damaged delimiter: it is dropped like a lost frame and never reaches
+   recv_frame().
+*/
+#define MAX_FRAME_LEN (PKT_LEN + 8)
+
 extern int  recv_frame(unsigned char *buf, int size);
-extern void send_frame(unsigned char *frame, int len);
+extern unsigned int send_frame(unsigned char *frame, int len);
+
+/* 
+   The same with the CRC-32 taken while the frame is encoded or decoded:
+   send_frame_crc() sends the frame followed by its 4 CRC bytes, and 
+   recv_frame_crc() sets *crc_ok if the received frame (CRC included, as
+   recv_frame() returns it) checks out.
+*/
+extern unsigned int send_frame_crc(unsigned char *frame, int len);
+extern int  recv_frame_crc(unsigned char *buf, int size, int *crc_ok);
+
+/* 
+   send_frame() and send_frame_crc() return a handle of the queued frame.
+   Until the frame starts going out, cancel_frame() takes it back and 
+   replace_frame() puts a new frame at its place in the queue (with a CRC
+   if the old one had it). Both return 0 if it is too late.
+*/
+extern int  cancel_frame(unsigned int handle);
+extern int  replace_frame(unsigned int handle, unsigned char *frame, int len);
 
 extern int  phl_sq_len(void);
 
 /* CRC-32 polynomium coding function */
 extern unsigned int crc32(unsigned char *buf, int len);
 
+/* ... computed piece by piece, starting from CRC32_INIT */
+#define CRC32_INIT 0xffffffff
+extern unsigned int crc32_update(unsigned int crc, const unsigned char *buf, int len);
+
 /* Timer Management functions */
 extern unsigned int get_ms(void);
+extern long long get_us(void);
 extern void start_timer(unsigned int nr, unsigned int ms);
 extern void stop_timer(unsigned int nr);
 extern void start_ack_timer(unsigned int ms);